@@ -1,9 +1,166 @@
+// pread / pwritev / preadv and fileno are not declared by strict -std= builds without it
+#define _DEFAULT_SOURCE
+
 #include "vmAlloc.h"
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Build with -DVM_LATENCY_HISTOGRAMS to time vm_translate / vm_map_page / vm_unmap_page with rdtsc (x86 only)
+#if defined(VM_LATENCY_HISTOGRAMS)
+#if !defined(__x86_64__) && !defined(__i386__)
+#error "VM_LATENCY_HISTOGRAMS needs rdtsc"
+#endif
+#include <x86intrin.h>
+#endif
+
+// Page table entry bits
+#define PTE_VALID   0b1         // a mapping exists for this entry
+#define PTE_PRESENT 0b10        // the mapped page is resident in physical memory
+#define PTE_READ    0b100
+#define PTE_WRITE   0b1000
+#define PTE_EXEC    0b10000
+#define PTE_USER    0b100000
+#define PTE_PERMS   0b111100    // user/exec/write/read, in that order from the top
+#define PTE_LARGE   0b1000000   // L1 only: the entry maps a 4 MiB superpage instead of an L2 table
+#define PTE_COW     0b1000000   // present L2 entries only: the page is shared and was writable, a write copies it
+#define PTE_SEQUENTIAL 0b10000000 // L1 entries of L2 tables only: vm_advise VM_ADVICE_SEQUENTIAL, faults read ahead
+#define PTE_RANDOM  0b100000000 // L1 entries of L2 tables only: vm_advise VM_ADVICE_RANDOM, swap ins read no neighbours
+#define PTE_ADVICE  (PTE_SEQUENTIAL | PTE_RANDOM)
+#define PTE_FRAME   0xFFFFF000
+#define PTE_SUPER_FRAME 0xFFC00000
+
+// A valid entry without PTE_PRESENT has been swapped out: it keeps its permission bits
+// and holds the swap slot of the page in the bits above them.
+// The last slot number is never a swap slot: it marks a page reserved by vm_reserve_page / vm_reserve_range
+// that has no physical page yet and gets a zeroed one on its first translation.
+#define PTE_SLOT_SHIFT 6
+#define PTE_ZERO_SLOT (0xFFFFFFFF >> PTE_SLOT_SHIFT)
+
+// Software TLB geometry, both must be powers of two.
+// The TLB is part of the metadata block, so it grows the reserved area at the start of physmem.
+#ifndef VM_TLB_SETS
+#define VM_TLB_SETS 32
+#endif
+#ifndef VM_TLB_WAYS
+#define VM_TLB_WAYS 4
+#endif
+
+// Number of PTEs vm_translate_batch gathers before checking them all at once
+#define VM_BATCH_CHUNK 64
+
+// Physically contiguous runs vm_read / vm_write translate before copying them
+#define VM_COPY_RUNS 16
+
+// Entries of the ASID table, 0 gives one per physical page but at least 512.
+// No more address spaces than physical pages can be active, as each one holds its top-level table.
+#ifndef VM_MAX_ASIDS
+#define VM_MAX_ASIDS 0
+#endif
+
+// Upper bound on the number of address space locks, the actual number scales with physical memory
+#define VM_SPACE_LOCKS 512
+
+// Free frames each magazine caches for the threads that hash to it, 0 turns the magazines off.
+// Upper bound on the number of magazines, the actual number scales with physical memory.
+#ifndef VM_MAGAZINE_SIZE
+#define VM_MAGAZINE_SIZE 32
+#endif
+#ifndef VM_MAGAZINES
+#define VM_MAGAZINES 16
+#endif
+
+// Set in a magazine slot when the cached frame is known to be all zero
+#define MAGAZINE_ZEROED 0x80000000
+
+// frameRefs of a frame: the number of PTEs mapping it besides the first, and whether vm_map_shared shared it.
+// A page shared that way stays writable for everyone, a clone does not turn it copy-on-write.
+#define FRAME_REFS   0x7FFFFFFF
+#define FRAME_SHARED 0x80000000
+
+// Most pages moved to or from the swap file in one system call: an eviction takes this many victims and writes
+// those that do not go to the compressed pool to consecutive slots, a fault reads back the neighbouring pages
+// swapped out with it
+#ifndef VM_SWAP_CLUSTER
+#define VM_SWAP_CLUSTER 8
+#endif
+
+// Pages after a faulting one that a translation brings in ahead of use, where vm_advise marked the range sequential.
+// Only free frames are used for them, nothing is evicted to make room.
+#ifndef VM_SEQUENTIAL_READAHEAD
+#define VM_SEQUENTIAL_READAHEAD 16
+#endif
+
+// Compressed swap pool in front of the swap file, in percent of physical memory, 0 turns it off.
+// Evicted pages are kept compressed in the pool and only written to the swap file when they do not compress
+// below ZSWAP_MAX_BYTES, or once the pool is full (oldest first). Instances without swap or below 64 pages have none.
+#ifndef VM_ZSWAP_PERCENT
+#define VM_ZSWAP_PERCENT 10
+#endif
+
+// The pool is handed out in units of ZSWAP_UNIT bytes, with one entry per ZSWAP_UNITS_PER_ENTRY units
+#define ZSWAP_UNIT 64
+#define ZSWAP_UNITS_PER_ENTRY 4
+#define ZSWAP_MAX_BYTES 3072
+#define ZSWAP_NONE 0xFFFFFFFF // End of a list of entries
 
-typedef struct freePageNode{
-    struct freePageNode* next;
-}freePageNode;
+// Page compressor: LZ77 sequences of literals and matches of at least LZ_MIN_MATCH bytes, see lzSequence
+#define LZ_HASH_BITS 10
+#define LZ_MIN_MATCH 4
+
+// Enough levels of 64-bit words for 64^6 items
+#define HBITMAP_MAX_LEVELS 6
+
+// Hierarchical bitmap of free items. Level 0 has one bit per item, set while the item is free.
+// Every level above has one bit per word of the level below, set while that word has a bit set.
+// The top level is a single word, so finding a free item is one ctz per level.
+typedef struct {
+    uint64_t* level[HBITMAP_MAX_LEVELS];
+    uint32_t bits[HBITMAP_MAX_LEVELS]; // Number of meaningful bits in each level
+    uint32_t levels;
+} hbitmap;
+
+// A TLB entry packs its tag and the cached PTE in one word so that a hit costs a single load:
+// - bits 63..44: frame number of the top-level page table (never 0, page 0 holds the metadata)
+// - bits 43..24: virtual page number
+// - bits 23..4:  physical frame number
+// - bits 3..0:   user/exec/write/read permission bits
+// An all-zero entry is invalid.
+typedef uint64_t tlbEntry;
+
+// Serializes the writers of an address space and lets vm_translate walk its tables without locking.
+// Address spaces share a lock when the frames of their top-level tables collide modulo the number of locks.
+typedef struct {
+    pthread_mutex_t lock; // Held by map / unmap / destroy and by translations that fault a page in
+    uint32_t seq; // Odd while a writer may be removing entries or freeing tables, bumped again when it is done
+} spaceLock;
+
+// Small per-thread stack of free frames, so that mapping and unmapping single pages rarely take frameLock.
+// Frames move between a magazine and the free frames in batches of half a magazine.
+typedef struct {
+    pthread_mutex_t lock; // Only contended by threads that hash to the same magazine
+    uint32_t count;
+    uint32_t* frames; // VM_MAGAZINE_SIZE slots, each a frame number, or'd with MAGAZINE_ZEROED if the frame is zero
+} magazine;
+
+// A swapped out page kept in the compressed pool rather than in its slot of the swap file.
+// Entries in use are on the hash chain of their slot and on the age list, free ones are chained through hashNext.
+typedef struct {
+    uint32_t slot;
+    uint32_t firstUnit;
+    uint32_t bytes; // Compressed size, 0 if the page is fill repeated
+    uint32_t hashNext;
+    uint32_t older;
+    uint32_t newer;
+    uint64_t fill;
+} zswapEntry;
 
 typedef struct {
     void*  vmStart;
@@ -12,11 +169,249 @@ typedef struct {
     uint32_t numPages;
     FILE* swapFile;
     uint32_t numSwapPages;
-    paddr_t asid[512]; // Stores the actual address in which the pt starts
-    freePageNode* freePageHeader; // The address of the header of the free page free list.
+    paddr_t* asid; // Per address space ID, the address at which its top-level table starts, 0 if inactive
+    uint32_t numAsids;
+    hbitmap zeroedFrames; // Per physical frame, set while the frame is free and known to be all zero
+    hbitmap dirtyFrames; // Per physical frame, set while the frame is free but still holds old contents
+    pthread_mutex_t frameLock; // Held while using the free frames, swap slots, frame owners or the eviction clock
+    uint32_t evictSeq; // Odd while a page is being evicted, bumped again once its TLB entries are gone
+    spaceLock* spaceLocks; // See getSpaceLock
+    uint32_t spaceLockMask; // Number of spaceLocks minus one
+    magazine* magazines; // See getMagazine
+    uint32_t numMagazines; // A power of two, or 0 if the instance is too small for magazines
+    uint64_t tlbHits;
+    uint64_t tlbMisses;
+    uint64_t badAddr; // Translations that found no mapping
+    uint64_t badPerm; // Translations refused by the permission bits
+    uint64_t swapIns; // Pages brought back from swap
+    uint64_t evictions; // Pages moved out to swap
+    uint64_t cleanEvictions; // Evictions of pages unchanged since their swap in, which wrote nothing
+    uint64_t swapReadahead; // Pages brought back from swap along with the one a translation faulted on
+    uint64_t swapFileReads;
+    uint64_t swapFileWrites;
+    uint64_t swapIoCalls;
+    uint64_t cowFaults; // Writes to copy-on-write pages
+    uint64_t zeroFills; // Reserved pages given a zeroed page by their first translation
+    uint64_t pagesMapped; // By vm_map_page, vm_map_range, vm_map_superpage and vm_map_shared
+    uint64_t pagesUnmapped; // By vm_unmap_page and vm_unmap_range
+    uint64_t pagesMerged; // By vm_dedup_scan
+    uint64_t prefetches; // Swap ins and zero fills done by vm_advise or sequential read ahead, ahead of any translation
+#if defined(VM_LATENCY_HISTOGRAMS)
+    uint64_t translateCycles[VM_STATS_LATENCY_BUCKETS]; // See recordLatency
+    uint64_t mapCycles[VM_STATS_LATENCY_BUCKETS];
+    uint64_t unmapCycles[VM_STATS_LATENCY_BUCKETS];
+#endif
+    uint8_t tlbVictim[VM_TLB_SETS]; // Next way to replace in each set (round robin)
+    tlbEntry tlb[VM_TLB_SETS][VM_TLB_WAYS];
+    uint32_t* frameOwner; // Per frame, physical address of the PTE mapping it (0 if it is not a data page, or is shared)
+    uint32_t* frameRefs; // Per frame, FRAME_REFS / FRAME_SHARED, only changed with frameLock held
+    uint64_t* referenced; // Per frame, second chance bit set on every translation of the page
+    uint64_t* accessed; // Per frame, set on every translation of the page until vm_scan_working_set clears it
+    uint64_t* written; // Per frame, set on every VM_WRITE translation of the page until vm_scan_working_set clears it
+    uint64_t* cold; // Per frame, set by vm_advise VM_ADVICE_COLD until the page is evicted, freed or found in use
+    uint32_t coldPages; // Bits set in cold
+    uint32_t coldHand; // Word of cold the eviction looks at first
+    uint32_t* frameSlot; // Per frame, 1 + the swap slot still holding the page as it was swapped in (0 if none)
+    uint32_t swapCopies; // Frames with a frameSlot, their slots are in use without holding a swapped out page
+    uint32_t* frameCount; // Per frame: number of valid entries of an L2 table, or the occupancy bitmap of an L1 table
+    uint32_t clockHand; // Next frame the eviction clock looks at
+    uint32_t* dedupTable; // Per content hash bucket, the last frame vm_dedup_scan saw with that hash
+    uint32_t dedupMask; // Number of dedupTable buckets minus one
+    uint32_t dedupCursor; // Frames vm_dedup_scan has looked at so far, modulo numPages it is the next one
+    hbitmap swapSlotFree; // Per swap slot, set while no swapped out page lives there
+    uint32_t swapCursor; // Slot after the last one allocated, searched first so evictions land next to each other
+    uint8_t* zswapPool; // Compressed swap pool, NULL if there is none
+    hbitmap zswapFreeUnits; // Per unit of the pool, set while it is free
+    zswapEntry* zswapEntries;
+    uint32_t* zswapBuckets; // Per hash bucket of slots, the first entry of its chain
+    uint32_t zswapBucketMask; // Number of zswapBuckets minus one
+    uint32_t zswapFreeEntry;
+    uint32_t zswapOldest; // Ends of the age list, the oldest entry is written back first
+    uint32_t zswapNewest;
+    uint32_t zswapPages; // Entries in use
+    uint64_t zswapBytes; // Compressed bytes held by the entries in use
 } metadata;
 
+#define CHECKPOINT_MAGIC "VMCKPT02"
+
+// First bytes of a checkpoint image written by vm_checkpoint. The header is followed by:
+// - the run tables: frameRuns runs of in-use frames, then slotRuns runs of used swap slots, padded to a page
+// - the reserved area of physical memory (the metadata block and the tables after it), reservedPages pages
+// - the contents of the frames of every frame run, in order, then those of the slots of every slot run
+// Everything after the run tables is page aligned so that vm_restore can map the frames straight from the file.
+typedef struct {
+    char magic[8]; // CHECKPOINT_MAGIC, without its terminator
+    uint32_t metadataSize; // sizeof(metadata), tells apart builds with another TLB geometry or latency histograms
+    uint32_t magazineSize; // VM_MAGAZINE_SIZE
+    uint32_t pageTableLevels; // VM_PAGE_TABLE_LEVELS
+    uint32_t physPages; // Pages of physical memory, reserved ones included
+    uint32_t reservedPages;
+    uint32_t swapSlots;
+    uint32_t frameRuns;
+    uint32_t slotRuns;
+} checkpointHeader;
+
+// Consecutive in-use frames, or used swap slots, of a checkpoint image
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} checkpointRun;
+
+
+
+// description:
+// - carves a table out of the reserved area at the start of physical memory
+// arguments:
+// - reservedEnd: the first byte not yet reserved, advanced past the new table
+// - bytes: the size of the table
+// returns:
+// - the start of the table, 8-byte aligned
+static void* reserveMetadata(uintptr_t* reservedEnd, size_t bytes){
+    void* table = (void*)((*reservedEnd + 7) & ~(uintptr_t)7);
+    *reservedEnd = (uintptr_t)table + bytes;
+    return table;
+}
+
+// description:
+// - computes how many words a hierarchical bitmap over size items needs
+// arguments:
+// - size: the number of items
+// returns:
+// - the number of uint64_t words, all levels included
+static size_t hbitmapWords(size_t size){
+    size_t total = 0;
+    for(size_t words = (size + 63) / 64; words > 0; words = (words + 63) / 64){
+        total += words;
+        if(words == 1) break;
+    }
+    return total;
+}
+
+// description:
+// - lays out a hierarchical bitmap over size items, all of them free
+// arguments:
+// - bitmap: the bitmap to initialize
+// - words: storage of at least hbitmapWords(size) words
+// - size: the number of items
+static void hbitmapInit(hbitmap* bitmap, uint64_t* words, size_t size){
+    bitmap->levels = 0;
+    for(size_t bits = size; bits > 0; bits = (bits + 63) / 64){
+        size_t wordCount = (bits + 63) / 64;
+        bitmap->level[bitmap->levels] = words;
+        bitmap->bits[bitmap->levels] = bits;
+        bitmap->levels++;
+
+        // Every bit of the level is set, the padding after the last one is not
+        for(size_t i = 0; i < wordCount; i++) words[i] = ~(uint64_t)0;
+        if(bits % 64) words[wordCount - 1] = ((uint64_t)1 << (bits % 64)) - 1;
+        words += wordCount;
+        if(wordCount == 1) break;
+    }
+}
+
+// Will mark an item of a hierarchical bitmap as taken, clearing summary bits whose word became empty.
+static void hbitmapClear(hbitmap* bitmap, uint32_t index){
+    for(uint32_t level = 0; level < bitmap->levels; level++){
+        uint64_t* word = &bitmap->level[level][index / 64];
+        *word &= ~((uint64_t)1 << (index % 64));
+        if(*word) return;
+        index /= 64;
+    }
+}
+
+// Will mark an item of a hierarchical bitmap as free, setting summary bits whose word was empty.
+static void hbitmapSet(hbitmap* bitmap, uint32_t index){
+    for(uint32_t level = 0; level < bitmap->levels; level++){
+        uint64_t* word = &bitmap->level[level][index / 64];
+        bool wasEmpty = (*word == 0);
+        *word |= (uint64_t)1 << (index % 64);
+        if(!wasEmpty) return;
+        index /= 64;
+    }
+}
+
+// description:
+// - finds the first free item at or after a position of a hierarchical bitmap
+// - climbs until a word has a set bit past the position, then descends taking the lowest set bit
+// arguments:
+// - bitmap: the bitmap to search
+// - from: the first item to consider
+// - index: receives the free item found
+// returns:
+// - true if a free item was found, false if every item from there on is taken
+static bool hbitmapNext(const hbitmap* bitmap, uint32_t from, uint32_t* index){
+    uint32_t level = 0;
+    uint32_t position = from;
+
+    for(;;){
+        if(level == bitmap->levels || position >= bitmap->bits[level]) return false;
+        uint64_t word = bitmap->level[level][position / 64] & (~(uint64_t)0 << (position % 64));
+        if(word){
+            position = (position & ~63u) + __builtin_ctzll(word);
+            break;
+        }
+        // Nothing left in this word, continue with the next word one level up
+        position = position / 64 + 1;
+        level++;
+    }
+
+    while(level > 0){
+        level--;
+        position = position * 64 + __builtin_ctzll(bitmap->level[level][position]);
+    }
+    *index = position;
+    return true;
+}
+
+// description:
+// - finds the first run of free items of a hierarchical bitmap that starts on an alignment boundary
+// - jumps from free item to free item with hbitmapNext, and past the first taken item of a run that does not fit
+// arguments:
+// - bitmap: the bitmap to search
+// - count: the length of the run
+// - align: the alignment of the first item of the run, a power of two
+// - index: receives the first item of the run
+// returns:
+// - true if a run was found, false otherwise
+static bool hbitmapFindRun(const hbitmap* bitmap, uint32_t count, uint32_t align, uint32_t* index){
+    uint32_t size = bitmap->levels ? bitmap->bits[0] : 0;
+    uint32_t position = 0;
+
+    while(hbitmapNext(bitmap, position, &position)){
+        uint32_t start = (position + align - 1) & ~(align - 1);
+        if(start > size || size - start < count) return false;
+
+        // Look for a taken item in [start, start + count), one word at a time
+        uint32_t taken = start + count;
+        for(uint32_t item = start; item < start + count; item = (item & ~63u) + 64){
+            uint64_t word = ~bitmap->level[0][item / 64] & (~(uint64_t)0 << (item % 64));
+            if(word){
+                taken = (item & ~63u) + __builtin_ctzll(word);
+                break;
+            }
+        }
+        if(taken >= start + count){
+            *index = start;
+            return true;
+        }
+        position = taken + 1;
+    }
+    return false;
+}
+
+// Will count the items of the bitmap that are set.
+static size_t hbitmapCount(const hbitmap* bitmap){
+    size_t count = 0;
+    for(uint32_t word = 0; word < (bitmap->bits[0] + 63) / 64; word++){
+        count += __builtin_popcountll(bitmap->level[0][word]);
+    }
+    return count;
+}
 
+// Will tell whether an item of a hierarchical bitmap is set.
+static bool hbitmapTest(const hbitmap* bitmap, uint32_t index){
+    return (bitmap->level[0][index / 64] >> (index % 64)) & 1;
+}
 
 // description:
 // - initializes a VM system
@@ -29,6 +424,8 @@ typedef struct {
 //   - physical page 0 starts at physmem
 // - swap
 //   - if non-null: pointer to a swap file opened in read-write mode with size 4096 * num_swap_pages bytes
+//     - unless built with -DVM_ZSWAP_PERCENT=0, a tenth of physical memory (VM_ZSWAP_PERCENT percent) then holds
+//       evicted pages compressed, and only pages that compress poorly or have aged out of it reach the file
 //   - if null: no swap space is available for this VM instance
 // - num_swap_pages: total number of 4096-byte pages available in the swap file
 //   - only relevant if swap is not null
@@ -36,34 +433,131 @@ typedef struct {
 // returns:
 // - on success, a non-NULL handle that uniquely identifies this VM instance;
 //   this will be passed unchanged to other vm_* functions
+//   - the handle may be used from several threads at once: calls on different address spaces
+//     only serialize while allocating or freeing physical pages, and vm_translate takes no lock
+//     when it finds the translation in the TLB or the page resident
 // - on failure (I/O error), NULL
 void *vm_init(void *physmem, size_t num_phys_pages, FILE *swap, size_t num_swap_pages) {
     // YOUR CODE HERE
     
     if(physmem == NULL)	return NULL;
     if(!num_phys_pages) return NULL;
+    if(swap != NULL && fseek(swap, 0, SEEK_SET) != 0) return NULL;
+
+    // Every swapped out page needs a PTE in a resident L2 table, so no more than 1024 slots
+    // per physical page can ever be in use. Only that many are tracked.
+    size_t swapSlots = (swap == NULL) ? 0 : num_swap_pages;
+    if(swapSlots > 1024 * num_phys_pages) swapSlots = 1024 * num_phys_pages;
+    if(swapSlots > PTE_ZERO_SLOT) swapSlots = PTE_ZERO_SLOT;
+
+    // The metadata block and the per frame / per slot tables after it occupy the first page(s)
+    // of physical memory, everything after them is allocatable
+    uintptr_t reservedEnd = (uintptr_t)physmem + sizeof(metadata);
+    uint32_t* frameOwner = reserveMetadata(&reservedEnd, num_phys_pages * sizeof(uint32_t));
+    uint32_t* frameRefs = reserveMetadata(&reservedEnd, num_phys_pages * sizeof(uint32_t));
+    uint64_t* referenced = reserveMetadata(&reservedEnd, (num_phys_pages + 63) / 64 * sizeof(uint64_t));
+    uint64_t* accessed = reserveMetadata(&reservedEnd, (num_phys_pages + 63) / 64 * sizeof(uint64_t));
+    uint64_t* written = reserveMetadata(&reservedEnd, (num_phys_pages + 63) / 64 * sizeof(uint64_t));
+    uint64_t* cold = reserveMetadata(&reservedEnd, (num_phys_pages + 63) / 64 * sizeof(uint64_t));
+    uint32_t* frameSlot = reserveMetadata(&reservedEnd, num_phys_pages * sizeof(uint32_t));
+    uint32_t* frameCount = reserveMetadata(&reservedEnd, num_phys_pages * sizeof(uint32_t));
+    size_t numAsids = VM_MAX_ASIDS ? VM_MAX_ASIDS : (num_phys_pages > 512 ? num_phys_pages : 512);
+    paddr_t* asidTable = reserveMetadata(&reservedEnd, numAsids * sizeof(paddr_t));
+    uint64_t* zeroedFrameWords = reserveMetadata(&reservedEnd, hbitmapWords(num_phys_pages) * sizeof(uint64_t));
+    uint64_t* dirtyFrameWords = reserveMetadata(&reservedEnd, hbitmapWords(num_phys_pages) * sizeof(uint64_t));
+    uint64_t* swapSlotWords = reserveMetadata(&reservedEnd, hbitmapWords(swapSlots) * sizeof(uint64_t));
+
+    // About one dedup bucket per frame, a power of two so that a hash picks its bucket with a mask
+    uint32_t dedupBuckets = 1;
+    while(dedupBuckets * 2 <= num_phys_pages) dedupBuckets *= 2;
+    uint32_t* dedupTable = reserveMetadata(&reservedEnd, dedupBuckets * sizeof(uint32_t));
+
+    // The compressed swap pool, with a power of two hash buckets of slots for about one entry each
+    size_t zswapUnits = 0;
+    if(swap != NULL && num_phys_pages >= 64) zswapUnits = num_phys_pages * VM_ZSWAP_PERCENT / 100 * (4096 / ZSWAP_UNIT);
+    uint32_t zswapEntries = zswapUnits / ZSWAP_UNITS_PER_ENTRY;
+    uint32_t zswapBuckets = 1;
+    while(zswapBuckets < zswapEntries) zswapBuckets *= 2;
+    uint8_t* zswapPool = reserveMetadata(&reservedEnd, zswapUnits * ZSWAP_UNIT);
+    zswapEntry* zswapEntryTable = reserveMetadata(&reservedEnd, zswapEntries * sizeof(zswapEntry));
+    uint32_t* zswapBucketTable = reserveMetadata(&reservedEnd, zswapBuckets * sizeof(uint32_t));
+    uint64_t* zswapUnitWords = reserveMetadata(&reservedEnd, hbitmapWords(zswapUnits) * sizeof(uint64_t));
+
+    // One address space lock per 8 physical pages, up to VM_SPACE_LOCKS, so that small instances still fit
+    uint32_t spaceLocks = 1;
+    while(spaceLocks < VM_SPACE_LOCKS && spaceLocks * 2 * 8 <= num_phys_pages) spaceLocks *= 2;
+    spaceLock* spaceLockTable = reserveMetadata(&reservedEnd, spaceLocks * sizeof(spaceLock));
+
+    // The magazines never cache more than a quarter of the frames, instances too small for one go without
+    uint32_t magazines = 0;
+    if(VM_MAGAZINE_SIZE > 0 && (size_t)VM_MAGAZINE_SIZE * 4 <= num_phys_pages){
+        magazines = 1;
+        while(magazines < VM_MAGAZINES && (size_t)magazines * 2 * VM_MAGAZINE_SIZE * 4 <= num_phys_pages) magazines *= 2;
+    }
+    magazine* magazineTable = reserveMetadata(&reservedEnd, magazines * sizeof(magazine));
+    uint32_t* magazineFrames = reserveMetadata(&reservedEnd, (size_t)magazines * VM_MAGAZINE_SIZE * sizeof(uint32_t));
+    size_t reservedPages = (reservedEnd - (uintptr_t)physmem + 4095) / 4096;
+    if(reservedPages >= num_phys_pages) return NULL;
+
     metadata* metaData = (metadata*)physmem;
-    memset(metaData, 0, sizeof(metadata));
+    memset(metaData, 0, reservedEnd - (uintptr_t)physmem);
 
     metaData->vmStart = physmem;
     metaData->vmEnd = (void*)((uintptr_t)physmem + 4096*num_phys_pages);
-    metaData->firstPage = (void*)((uintptr_t)physmem + 4096);
-    metaData->numPages = num_phys_pages - 1;
-    metaData->swapFile = NULL;
-    metaData->numSwapPages = num_swap_pages;
-    metaData->freePageHeader = (freePageNode*)((uintptr_t)physmem + 4096);
-    
-    for(uint32_t i = 0; i < 512; i+=4096) {
-        metaData->asid[i] = 0;
+    metaData->firstPage = (void*)((uintptr_t)physmem + 4096*reservedPages);
+    metaData->numPages = num_phys_pages - reservedPages;
+    metaData->swapFile = swap;
+    metaData->numSwapPages = swapSlots;
+    metaData->frameOwner = frameOwner;
+    metaData->frameRefs = frameRefs;
+    metaData->referenced = referenced;
+    metaData->accessed = accessed;
+    metaData->written = written;
+    metaData->cold = cold;
+    metaData->frameSlot = frameSlot;
+    metaData->frameCount = frameCount;
+    metaData->asid = asidTable;
+    metaData->numAsids = numAsids;
+    metaData->clockHand = reservedPages;
+    metaData->dedupTable = dedupTable;
+    metaData->dedupMask = dedupBuckets - 1;
+    metaData->spaceLocks = spaceLockTable;
+    metaData->spaceLockMask = spaceLocks - 1;
+    pthread_mutex_init(&metaData->frameLock, NULL);
+    for(uint32_t i = 0; i < spaceLocks; i++){
+        pthread_mutex_init(&spaceLockTable[i].lock, NULL);
+    }
+    metaData->magazines = magazineTable;
+    metaData->numMagazines = magazines;
+    for(uint32_t i = 0; i < magazines; i++){
+        pthread_mutex_init(&magazineTable[i].lock, NULL);
+        magazineTable[i].frames = magazineFrames + (size_t)i * VM_MAGAZINE_SIZE;
     }
+    hbitmapInit(&metaData->swapSlotFree, swapSlotWords, swapSlots);
 
-    freePageNode* page = metaData->freePageHeader;
+    metaData->zswapPool = zswapUnits ? zswapPool : NULL;
+    metaData->zswapEntries = zswapEntryTable;
+    metaData->zswapBuckets = zswapBucketTable;
+    metaData->zswapBucketMask = zswapBuckets - 1;
+    metaData->zswapFreeEntry = zswapEntries ? 0 : ZSWAP_NONE;
+    metaData->zswapOldest = ZSWAP_NONE;
+    metaData->zswapNewest = ZSWAP_NONE;
+    memset(zswapBucketTable, 0xFF, zswapBuckets * sizeof(uint32_t));
+    for(uint32_t i = 0; i < zswapEntries; i++){
+        zswapEntryTable[i].hashNext = (i + 1 < zswapEntries) ? i + 1 : ZSWAP_NONE;
+    }
+    hbitmapInit(&metaData->zswapFreeUnits, zswapUnitWords, zswapUnits);
 
-    for (size_t i = 1; i < num_phys_pages - 1; i++) {
-        page->next = (freePageNode*)((uintptr_t)page + 4096);
-        page = page->next;
+    // Every frame starts out free except the reserved ones. Nothing is known about their contents,
+    // so they are dirty until vm_idle_zero or an allocation clears them.
+    hbitmapInit(&metaData->zeroedFrames, zeroedFrameWords, num_phys_pages);
+    hbitmapInit(&metaData->dirtyFrames, dirtyFrameWords, num_phys_pages);
+    for(uint32_t frame = 0; frame < num_phys_pages; frame++){
+        hbitmapClear(&metaData->zeroedFrames, frame);
+    }
+    for(uint32_t frame = 0; frame < reservedPages; frame++){
+        hbitmapClear(&metaData->dirtyFrames, frame);
     }
-    page->next = NULL;
     return physmem;
 }
 
@@ -100,371 +594,3801 @@ static uint32_t getOffset(vaddr_t addr){
         return (addr & 0xFFF);
 }
 
+// Will give the offset of addr in its 4 GiB region, which is what the 2-level table of the region is walked with.
+// With 2-level page tables the only region is the whole address space.
+static vaddr_t regionOffset(vaddr_t addr){
+#if VM_PAGE_TABLE_LEVELS == 4
+    return addr & 0xFFFFFFFF;
+#else
+    return addr;
+#endif
+}
+
 // description:
-// - translates a virtual address to a physical address if possible
+// - builds the 4 KiB PTE equivalent of one page of a superpage
 // arguments:
-// - vm: a VM system handle returned from vm_init
-// - pt: physical address of the top-level page table of the address space being accessed
-// - addr: the virtual address to translate
-// - access: the access being made (instruction fetch, read, or write)
-// - user: the access is a user-level access (i.e., not a kernel access)
-// input invariants:
-// - pt was previously returned by vm_new_addr_space()
+// - firstLevelEntry: the L1 entry mapping the superpage
+// - secondLevel: the second level page offset of the page within the superpage
 // returns:
-// - the success status of the translation:
-//   - VM_OK if translation succeeded
-//   - VM_BAD_ADDR if there is no translation for this address
-//   - VM_BAD_PERM if permissions are not sufficient for the type / source of access requested
-//   - VM_BAD_IO if accessing the swap file failed
-// - the resulting physical address (relevant only if status is VM_OK)
-vm_result_t vm_translate(void *vm, paddr_t pt, vaddr_t addr, access_type_t access, bool user) {
-    // YOUR CODE HERE
-    uint32_t firstLevelPage = getFirstLevel(addr);
-    uint32_t secondLevelPage = getSecondLevel(addr);
-    uint32_t pageOffset = getOffset(addr);
-    
-    vm_result_t translationResult;
-    // Must look into first level page table and seek entry
-    uint32_t * firstLevelEntry = (uint32_t*)(pt + firstLevelPage*4 + ((metadata*)vm)->vmStart);
+// - the entry the page would have in an L2 table
+static uint32_t superpageEntry(uint32_t firstLevelEntry, uint32_t secondLevel){
+    return (firstLevelEntry & PTE_SUPER_FRAME) | (secondLevel << 12) | (firstLevelEntry & (PTE_PERMS | PTE_VALID | PTE_PRESENT));
+}
 
-    // Check if first level page entry is valid
-    if(!(*(firstLevelEntry) & 0b1)){
-	    translationResult.status = VM_BAD_ADDR;
-	    translationResult.addr = 0;
-	    return translationResult;
-    }
+// Will turn a writable entry into a read-only copy-on-write one, other entries are returned as they are.
+static uint32_t copyOnWriteEntry(uint32_t pageTableEntry){
+    if(!(pageTableEntry & PTE_WRITE)) return pageTableEntry;
+    return (pageTableEntry & ~PTE_WRITE) | PTE_COW;
+}
 
-    // Look into second level page table and seek entry
-    uint32_t * secondLevelEntry = (uint32_t*)(((metadata*)vm)->vmStart + (*firstLevelEntry & 0xFFFFF000) + secondLevelPage*4);
+// Will tell whether an L2 entry is reserved by vm_reserve_page / vm_reserve_range and still has no page.
+static bool reservedEntry(uint32_t pageTableEntry){
+    return (pageTableEntry & (PTE_VALID | PTE_PRESENT)) == PTE_VALID && pageTableEntry >> PTE_SLOT_SHIFT == PTE_ZERO_SLOT;
+}
 
-   // Check if second level page entry is valid
-   if(!(*secondLevelEntry & 0b1)){ 
-        translationResult.status = VM_BAD_ADDR;
-        translationResult.addr = 0;
-        return translationResult;
-   }
-
-   // Check if the user can access the data
-   if(user){
-	   if(!(*secondLevelEntry & 0b100000)){
-		   translationResult.status = VM_BAD_PERM;
-		   translationResult.addr = 0;
-		   return translationResult;
-	   }
-   }
-
-   // Check if specific access type is allowed
-   if(access == VM_EXEC){
-	   if(!(*secondLevelEntry & 0b10000)){
-		translationResult.status = VM_BAD_PERM;
-		translationResult.addr = 0;
-		return translationResult;
-	   }
-   }else if(access == VM_READ){
-           if(!(*secondLevelEntry & 0b100)){
-                translationResult.status = VM_BAD_PERM;
-                translationResult.addr = 0;
-		return translationResult;
-           }
-   }else if(access == VM_WRITE){
-           if(!(*secondLevelEntry & 0b1000)){
-                translationResult.status = VM_BAD_PERM;
-                translationResult.addr = 0;
-                return translationResult;
-           }
-   }
+// Will read a page table entry that another thread may be writing.
+static uint32_t loadEntry(const uint32_t* entry){
+    return __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+}
+
+// Will write a page table entry so that lock-free readers see either the old or the new value,
+// and everything written before it (e.g. the zeroed page it maps).
+static void storeEntry(uint32_t* entry, uint32_t value){
+    __atomic_store_n(entry, value, __ATOMIC_RELEASE);
+}
+
+// PTE bit that must be set for each access_type_t
+static const uint32_t accessPermission[] = {
+    [VM_EXEC] = PTE_EXEC,
+    [VM_READ] = PTE_READ,
+    [VM_WRITE] = PTE_WRITE
+};
+
+// vm_translate_batch writes results with vector stores of interleaved (status, addr) pairs
+_Static_assert(sizeof(vm_result_t) == 8, "vm_result_t must be two packed 32-bit words");
 
-   // Return the mapping from the second table entry
-   translationResult.status = VM_OK;
-   translationResult.addr = (*secondLevelEntry & 0xFFFFF000) + pageOffset;
-   return translationResult;
+// description:
+// - builds the tag half of a TLB entry from a top-level page table and virtual address
+// arguments:
+// - pt: physical address of the top-level page table
+// - addr: the virtual address that is to be translated
+// returns:
+// - the tag, already shifted into bits 63..24 of a tlbEntry
+static tlbEntry tlbTag(paddr_t pt, vaddr_t addr){
+    return ((tlbEntry)(pt >> 12) << 44) | ((tlbEntry)((addr >> 12) & 0xFFFFF) << 24);
+}
+
+// description:
+// - looks up the TLB for a translation of addr in the address space rooted at pt
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level page table
+// - addr: the virtual address that is to be translated
+// - pageTableEntry: on a hit, receives the cached PTE (valid, present and permission bits included)
+// returns:
+// - true on a hit, false on a miss
+static bool tlbLookup(metadata* metaData, paddr_t pt, vaddr_t addr, uint32_t* pageTableEntry){
+    tlbEntry tag = tlbTag(pt, addr);
+    tlbEntry* set = metaData->tlb[(addr >> 12) & (VM_TLB_SETS - 1)];
 
+    for(int way = 0; way < VM_TLB_WAYS; way++){
+        tlbEntry entry = __atomic_load_n(&set[way], __ATOMIC_RELAXED);
+        if((entry & ~(tlbEntry)0xFFFFFF) == tag){
+            __atomic_fetch_add(&metaData->tlbHits, 1, __ATOMIC_RELAXED);
+            *pageTableEntry = (((uint32_t)entry << 8) & PTE_FRAME) | (((uint32_t)entry & 0xF) << 2) | PTE_VALID | PTE_PRESENT;
+            return true;
+        }
+    }
+    __atomic_fetch_add(&metaData->tlbMisses, 1, __ATOMIC_RELAXED);
+    return false;
 }
 
-// Will add a node to the linked list of free pages. 
-// Does so by adding it to the header of the list.
-static void addFreeList(void *vm, void* address){
-    metadata* metaData = (metadata*)vm;
-    freePageNode* newPage = (freePageNode*)address;
-    newPage->next = metaData->freePageHeader;
-    metaData->freePageHeader = newPage;
+// Will cache a PTE in the TLB.
+// Uses a free way of the set if there is one, otherwise replaces the ways round robin.
+// Racing inserts may overwrite each other, which only costs a later miss.
+static void tlbInsert(metadata* metaData, paddr_t pt, vaddr_t addr, uint32_t pageTableEntry){
+    uint32_t setIndex = (addr >> 12) & (VM_TLB_SETS - 1);
+    tlbEntry* set = metaData->tlb[setIndex];
+    tlbEntry entry = tlbTag(pt, addr) | ((pageTableEntry & PTE_FRAME) >> 8) | ((pageTableEntry & PTE_PERMS) >> 2);
+
+    for(int way = 0; way < VM_TLB_WAYS; way++){
+        if(__atomic_load_n(&set[way], __ATOMIC_RELAXED) == 0){
+            __atomic_store_n(&set[way], entry, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    uint8_t victim = __atomic_load_n(&metaData->tlbVictim[setIndex], __ATOMIC_RELAXED);
+    __atomic_store_n(&set[victim], entry, __ATOMIC_RELAXED);
+    __atomic_store_n(&metaData->tlbVictim[setIndex], (victim + 1) & (VM_TLB_WAYS - 1), __ATOMIC_RELAXED);
 }
 
-// Will remove a node from the linked list of free pages.
-// Does so by pointer before taking the node's pointer.
-static void removeFreeList(void *vm, freePageNode* address){
-    metadata* metaData = (metadata*)vm;
-    freePageNode* pageToRemove = address;
+// Will drop a TLB entry if it still holds the value that was matched, so a concurrent insert is not lost.
+static void tlbDrop(tlbEntry* slot, tlbEntry entry){
+    __atomic_compare_exchange_n(slot, &entry, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
 
-    //Check if linked list is not empty
-    if (!metaData || metaData->freePageHeader == NULL) return;
+// Will drop the TLB entry (if any) for the page containing addr in the address space rooted at pt.
+static void tlbInvalidatePage(metadata* metaData, paddr_t pt, vaddr_t addr){
+    tlbEntry tag = tlbTag(pt, addr);
+    tlbEntry* set = metaData->tlb[(addr >> 12) & (VM_TLB_SETS - 1)];
 
-    // Check if the node is the header of the free list.
-    if(address == metaData->freePageHeader){
-        metaData->freePageHeader = pageToRemove->next;
-        *((uintptr_t*)pageToRemove) = 0;
-        return;
+    for(int way = 0; way < VM_TLB_WAYS; way++){
+        tlbEntry entry = __atomic_load_n(&set[way], __ATOMIC_RELAXED);
+        if((entry & ~(tlbEntry)0xFFFFFF) == tag) tlbDrop(&set[way], entry);
     }
-    freePageNode* page = metaData->freePageHeader;
+}
 
-    for(freePageNode* page = metaData->freePageHeader; page != NULL; page = page->next){
-        if(page->next == address){
-            page->next = pageToRemove->next;
-            *((uintptr_t*)pageToRemove) = 0;
-            return;
+// Will drop every TLB entry that belongs to the address space rooted at pt.
+static void tlbInvalidateSpace(metadata* metaData, paddr_t pt){
+    for(int setIndex = 0; setIndex < VM_TLB_SETS; setIndex++){
+        for(int way = 0; way < VM_TLB_WAYS; way++){
+            tlbEntry entry = __atomic_load_n(&metaData->tlb[setIndex][way], __ATOMIC_RELAXED);
+            if((entry >> 44) == (pt >> 12)) tlbDrop(&metaData->tlb[setIndex][way], entry);
+        }
+    }
+}
+
+// Will drop every TLB entry of the address space rooted at pt that lies in the 4 MiB region containing addr.
+static void tlbInvalidateRegion(metadata* metaData, paddr_t pt, vaddr_t addr){
+    tlbEntry tag = tlbTag(pt, addr & PTE_SUPER_FRAME);
+    for(int setIndex = 0; setIndex < VM_TLB_SETS; setIndex++){
+        for(int way = 0; way < VM_TLB_WAYS; way++){
+            tlbEntry entry = __atomic_load_n(&metaData->tlb[setIndex][way], __ATOMIC_RELAXED);
+            if((entry >> 34) == (tag >> 34)) tlbDrop(&metaData->tlb[setIndex][way], entry);
+        }
+    }
+}
+
+// Will drop every TLB entry that translates to the given physical frame.
+static void tlbInvalidateFrame(metadata* metaData, uint32_t frame){
+    for(int setIndex = 0; setIndex < VM_TLB_SETS; setIndex++){
+        for(int way = 0; way < VM_TLB_WAYS; way++){
+            tlbEntry entry = __atomic_load_n(&metaData->tlb[setIndex][way], __ATOMIC_RELAXED);
+            if(entry != 0 && ((entry >> 4) & 0xFFFFF) == frame) tlbDrop(&metaData->tlb[setIndex][way], entry);
         }
     }
 }
 
+#if defined(VM_LATENCY_HISTOGRAMS)
+// Will count a call that started at rdtsc value start in a histogram: bucket b counts the calls that took
+// 2^b to 2^(b+1) - 1 cycles, the last bucket also counts anything slower.
+static void recordLatency(uint64_t* histogram, uint64_t start){
+    uint64_t cycles = __rdtsc() - start;
+    uint32_t bucket = (cycles == 0) ? 0 : 63 - __builtin_clzll(cycles);
+    if(bucket >= VM_STATS_LATENCY_BUCKETS) bucket = VM_STATS_LATENCY_BUCKETS - 1;
+    __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+#endif
+
+// Will set the second chance and accessed bits of a frame, and its written bit for a write.
+// Only writes when a bit is clear so that repeated translations of a hot page stay read-only.
+static void markReferenced(metadata* metaData, uint32_t frame, bool write){
+    uint64_t bit = (uint64_t)1 << (frame % 64);
+    if(!(__atomic_load_n(&metaData->referenced[frame / 64], __ATOMIC_RELAXED) & bit)){
+        __atomic_fetch_or(&metaData->referenced[frame / 64], bit, __ATOMIC_RELAXED);
+    }
+    if(!(__atomic_load_n(&metaData->accessed[frame / 64], __ATOMIC_RELAXED) & bit)){
+        __atomic_fetch_or(&metaData->accessed[frame / 64], bit, __ATOMIC_RELAXED);
+    }
+    if(write && !(__atomic_load_n(&metaData->written[frame / 64], __ATOMIC_RELAXED) & bit)){
+        __atomic_fetch_or(&metaData->written[frame / 64], bit, __ATOMIC_RELAXED);
+    }
+}
+
+// Will clear the second chance bit of a frame.
+static void clearReferenced(metadata* metaData, uint32_t frame){
+    __atomic_fetch_and(&metaData->referenced[frame / 64], ~((uint64_t)1 << (frame % 64)), __ATOMIC_RELAXED);
+}
+
+// Will set the second chance bit of a frame, without counting it as accessed.
+static void setReferenced(metadata* metaData, uint32_t frame){
+    __atomic_fetch_or(&metaData->referenced[frame / 64], (uint64_t)1 << (frame % 64), __ATOMIC_RELAXED);
+}
+
+// Will clear the cold bit of a frame, returning whether it was set.
+static bool clearCold(metadata* metaData, uint32_t frame){
+    uint64_t bit = (uint64_t)1 << (frame % 64);
+    if(!(__atomic_load_n(&metaData->cold[frame / 64], __ATOMIC_RELAXED) & bit)) return false;
+    if(!(__atomic_fetch_and(&metaData->cold[frame / 64], ~bit, __ATOMIC_RELAXED) & bit)) return false;
+    __atomic_fetch_sub(&metaData->coldPages, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Will clear the second chance, accessed, written and cold bits of a frame whose page is being freed.
+static void clearAccessBits(metadata* metaData, uint32_t frame){
+    uint64_t mask = ~((uint64_t)1 << (frame % 64));
+    __atomic_fetch_and(&metaData->referenced[frame / 64], mask, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&metaData->accessed[frame / 64], mask, __ATOMIC_RELAXED);
+    __atomic_fetch_and(&metaData->written[frame / 64], mask, __ATOMIC_RELAXED);
+    clearCold(metaData, frame);
+}
+
+// Will tell whether a frame was translated for VM_WRITE since its written bit was last cleared.
+static bool testWritten(metadata* metaData, uint32_t frame){
+    return (__atomic_load_n(&metaData->written[frame / 64], __ATOMIC_RELAXED) >> (frame % 64)) & 1;
+}
 
 // description:
-// - adds a top-level page table for an address space
+// - finds the lock of the address space rooted at pt
+// - hashing the frame of the top-level table, rather than looking up the ASID, keeps this O(1)
+//   for every vm_* function, most of which only get pt
 // arguments:
-// - vm: a VM system handle returned from vm_init
-// - asid: address space ID of for which the toplevel page table should be created
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level page table
 // returns:
-// - the success status:
-//   - VM_OK if a new page table was created
-//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
-//   - VM_BAD_IO if accessing the swap file failed
-// - the physical address of the *top-level* page table for this address space (relevant only if status is VM_OK)
-// input invariants:
-// - 0 <= asid < 512
-// - asid is not currently active
-// output invariants:
-// - a toplevel page table for address space asid exists in physical memory
-vm_result_t vm_new_addr_space(void *vm, asid_t asid) {
-    // YOUR CODE HERE
-    metadata* metaData = (metadata*)vm;
-    vm_result_t result;
+// - the lock
+static spaceLock* getSpaceLock(metadata* metaData, paddr_t pt){
+    return &metaData->spaceLocks[(pt >> 12) & metaData->spaceLockMask];
+}
 
-    // Check if ASID already has an L1 table
-    if(!metaData || metaData->asid[asid] != 0) {
-        return (vm_result_t){ .status = VM_DUPLICATE };
-    }
+// Will mark the start of a change that lock-free readers must not trust (removing entries, freeing tables).
+// Readers that saw the sequence count odd, or changed across their walk, retry with the lock held.
+static void beginRemoval(uint32_t* seq){
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+}
 
-    // Check if there is a free page available
-    if(!metaData || metaData->freePageHeader == NULL) return (vm_result_t){ .status = VM_OUT_OF_MEM };
+// Will mark the end of a change started with beginRemoval.
+static void endRemoval(uint32_t* seq){
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+}
 
-    // Allocate the header of the freelist and remove it from the free list.
-    freePageNode* freePage = metaData->freePageHeader;
-    removeFreeList(vm, freePage);
-    
-    // Set the freePage to be one of the top level page tables.
-    metaData->asid[asid] = (uintptr_t)freePage - (uintptr_t)metaData->vmStart;
+// Will return an all-zero physical page to the free frames.
+static void addFreePage(metadata* metaData, void* page){
+    hbitmapSet(&metaData->zeroedFrames, ((uintptr_t)page - (uintptr_t)metaData->vmStart) >> 12);
+}
 
-    // Zero out the new L1 table (ensure all entries are initially invalid)
-    memset((void*)freePage, 0, 4096);
-    result.status = VM_OK;
-    result.addr = (uintptr_t)freePage - (uintptr_t)metaData->vmStart;
-    return result;
+// Will return a physical page with old contents to the free frames, it is zeroed later.
+static void addDirtyPage(metadata* metaData, void* page){
+    hbitmapSet(&metaData->dirtyFrames, ((uintptr_t)page - (uintptr_t)metaData->vmStart) >> 12);
 }
 
+// Will clear a page with non-temporal stores, so zeroing pages ahead of time does not flush the cache.
+// The stores must be fenced with zeroFence before the page is handed out.
+static void zeroPageNonTemporal(void* page){
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(__m128i* line = (__m128i*)page; line < (__m128i*)page + 256; line += 4){
+        _mm_stream_si128(line, zero);
+        _mm_stream_si128(line + 1, zero);
+        _mm_stream_si128(line + 2, zero);
+        _mm_stream_si128(line + 3, zero);
+    }
+#else
+    memset(page, 0, 4096);
+#endif
+}
 
+// Will order the non-temporal stores of zeroPageNonTemporal before any later store.
+static void zeroFence(void){
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
 
 // description:
-// - entirely removes an address space
+// - takes the lowest free physical page without evicting anything
+// - pages that must be zeroed come from the zeroed frames first, the others from the dirty frames first
 // arguments:
-// - vm: a VM system handle returned from vm_init
-// - asid: the ID of the address space to be removed
+// - metaData: the VM system metadata
+// - zeroed: the page must be all zero
 // returns:
-// - the success status:
-//   - VM_OK if the address space was successfully removed
-//   - VM_BAD_ADDR if the toplevel page table for this address pace does not exist
-//   - VM_BAD_IO if accessing the swap file failed
-// input invariants:
-// - 0 <= asid < 512
-// - asid is currently active
-// output invariants:
-// - all pages and page tables used by address space asid are no longer allocated in physical memory or swap
-vm_status_t vm_destroy_addr_space(void *vm, asid_t asid) {
-    // YOUR CODE HERE
-    metadata* metaData = (metadata*)vm;
+// - the page, or NULL if no frame is free
+static void* takeFreePage(metadata* metaData, bool zeroed){
+    hbitmap* preferred = zeroed ? &metaData->zeroedFrames : &metaData->dirtyFrames;
+    hbitmap* fallback = zeroed ? &metaData->dirtyFrames : &metaData->zeroedFrames;
+    uint32_t frame;
 
-    // Check if the address space has a top level page table
-    if(metaData->asid[asid] == 0) return VM_BAD_ADDR;
+    if(hbitmapNext(preferred, 0, &frame)){
+        hbitmapClear(preferred, frame);
+        return (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12));
+    }
+    if(!hbitmapNext(fallback, 0, &frame)) return NULL;
+    hbitmapClear(fallback, frame);
 
-    // Get pointer to the top level page table
-    void* topLevelPage = (void*)(metaData->asid[asid] + (uintptr_t)vm);
+    // No zeroed page was ready, clear a dirty one on the spot
+    void* page = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12));
+    if(zeroed) memset(page, 0, 4096);
+    return page;
+}
 
-    if((uintptr_t)topLevelPage % 4096 != 0){ 
-        printf("Top level not aligned.\n");
-        return VM_BAD_IO;
-    }
+// description:
+// - takes a run of physically contiguous free pages without evicting anything
+// arguments:
+// - metaData: the VM system metadata
+// - count: the number of pages
+// - align: the alignment of the first page in pages, a power of two
+// returns:
+// - the first page of the run (all zero), or NULL if no such run is free
+static void* takeFreePageRun(metadata* metaData, uint32_t count, uint32_t align){
+    uint32_t frame;
 
-    // Loop through the top level page, if page is mapped (bit is valid) iterate through second
-    // level page freeing all of the physical pages it maps to
-    for(int i = 0; i < 4096; i+=4){
-        uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)topLevelPage + i);
-        // Check if entry is valid
-        if(*firstLevelEntry & 0b1){
-            
-            void* secondLevelPage = (void*)((uintptr_t)vm + (*firstLevelEntry & 0xFFFFF000));
-            if((uintptr_t)secondLevelPage % 4096 != 0){ 
-                printf("Top level not aligned.\n");
-                return VM_BAD_IO;
-            }
-            // Iterate over second level page 
-            for(int i = 0; i < 4096; i+=4){
-                uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)secondLevelPage + i);
-                
-                //Check if entry is valid
-                if(*secondLevelEntry & 0b1){
-                    // Free physical page
-                    void* physicalPage = (void*)((*secondLevelEntry & 0xFFFFF000) + (uintptr_t)vm);
-                    memset(physicalPage, 0, 4096);
-                    addFreeList(vm, physicalPage);
-                }
-            }
-            addFreeList(vm, secondLevelPage);
+    // Runs are only taken from zeroed frames. If none fits, zero every dirty frame and look again.
+    if(!hbitmapFindRun(&metaData->zeroedFrames, count, align, &frame)){
+        while(hbitmapNext(&metaData->dirtyFrames, 0, &frame)){
+            hbitmapClear(&metaData->dirtyFrames, frame);
+            memset((void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12)), 0, 4096);
+            hbitmapSet(&metaData->zeroedFrames, frame);
         }
+        if(!hbitmapFindRun(&metaData->zeroedFrames, count, align, &frame)) return NULL;
     }
-    addFreeList(vm, topLevelPage);
-    metaData->asid[asid] = 0;
-    return VM_OK;
+    for(uint32_t i = 0; i < count; i++){
+        hbitmapClear(&metaData->zeroedFrames, frame + i);
+    }
+    return (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12));
 }
 
 // description:
-// - creates a mapping for a new page in the virtual address space and map it to a physical page
+// - claims consecutive free swap slots, preferring those right after the last slots claimed so that
+//   consecutive evictions occupy a contiguous run of the swap file
 // arguments:
-// - vm: a VM system handle returned from vm_init
-// - pt: physical address of the top-level page table
-// - addr: the virtual address on a page that is to be mapped (not necessarily the start of the page)
-// - user: the page is accessible from user-level processes
-// - exec: instructions may be fetched from this page
-// - write: data may be written to this page
-// - read: data may be read from this page
+// - metaData: the VM system metadata
+// - count: the number of slots
+// - slot: receives the first claimed slot
 // returns:
-// - the success status of the mapping:
-//   - VM_OK if the mapping succeeded
-//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
-//   - VM_DUPLICATE if a mapping for this page already exists
-//   - VM_BAD_IO if accessing the swap file failed
-// input invariants:
-// - pt was previously returned by vm_new_addr_space()
-vm_status_t vm_map_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read) {
+// - true if the slots were claimed, false if no run of count free slots is left
+static bool swapSlotAlloc(metadata* metaData, uint32_t count, uint32_t* slot){
+    uint32_t first = metaData->swapCursor;
+    bool found = hbitmapNext(&metaData->swapSlotFree, first, &first) && count <= metaData->numSwapPages - first;
+    for(uint32_t i = 1; found && i < count; i++) found = hbitmapTest(&metaData->swapSlotFree, first + i);
+    if(!found && !hbitmapFindRun(&metaData->swapSlotFree, count, 1, &first)) return false;
+
+    for(uint32_t i = 0; i < count; i++) hbitmapClear(&metaData->swapSlotFree, first + i);
+    metaData->swapCursor = first + count;
+    *slot = first;
+    return true;
+}
+
+// description:
+// - moves pages between physical memory and consecutive slots of the swap file
+// - one preadv / pwritev on the descriptor of the swap file moves them all, unless the kernel moves less than asked
+// arguments:
+// - metaData: the VM system metadata
+// - slot: the first swap slot
+// - pages: the physical pages, one per slot
+// - count: the number of pages, at most VM_SWAP_CLUSTER
+// - write: true to copy the pages to the swap file, false to copy the slots into the pages
+// returns:
+// - VM_OK on success, VM_BAD_IO if the swap file could not be accessed
+static vm_status_t swapFileTransfer(metadata* metaData, uint32_t slot, void* const* pages, uint32_t count, bool write){
+    struct iovec vectors[VM_SWAP_CLUSTER];
+    for(uint32_t i = 0; i < count; i++){
+        vectors[i].iov_base = pages[i];
+        vectors[i].iov_len = 4096;
+    }
+
+    int file = fileno(metaData->swapFile);
+    off_t offset = (off_t)slot * 4096;
+    uint32_t first = 0;
+    while(first < count){
+        ssize_t done = write ? pwritev(file, vectors + first, count - first, offset) : preadv(file, vectors + first, count - first, offset);
+        __atomic_fetch_add(&metaData->swapIoCalls, 1, __ATOMIC_RELAXED);
+        if(done <= 0) return VM_BAD_IO;
+
+        // Step over the pages moved in full, and past the part moved of the next one
+        offset += done;
+        while(done > 0){
+            size_t part = ((size_t)done < vectors[first].iov_len) ? (size_t)done : vectors[first].iov_len;
+            vectors[first].iov_base = (char*)vectors[first].iov_base + part;
+            vectors[first].iov_len -= part;
+            done -= part;
+            if(vectors[first].iov_len == 0) first++;
+        }
+    }
+    __atomic_fetch_add(write ? &metaData->swapFileWrites : &metaData->swapFileReads, count, __ATOMIC_RELAXED);
+    return VM_OK;
+}
+
+// Will write a length that did not fit in the 4 bits of a sequence token, 255 at a time.
+static uint32_t lzPutLength(uint8_t* out, uint32_t at, uint32_t length){
+    while(length >= 255){
+        out[at++] = 255;
+        length -= 255;
+    }
+    out[at++] = length;
+    return at;
+}
+
+// description:
+// - appends one sequence to a compressed page: a token, the literals, then the match they are followed by
+// - the token holds the number of literals in its high 4 bits and the match length minus LZ_MIN_MATCH in its
+//   low 4; a field of 15 continues in the bytes after the token (literals) or after the offset (match)
+// - the match is a 2-byte little endian offset back into the page; the last sequence has none
+// arguments:
+// - out: the compressed page
+// - at: the end of the compressed page so far
+// - limit: the size out may not exceed
+// - literals, literalCount: the bytes to copy as they are
+// - offset, length: the match, length 0 for the last sequence
+// returns:
+// - the new end of the compressed page, or limit + 1 if the sequence did not fit
+static uint32_t lzSequence(uint8_t* out, uint32_t at, uint32_t limit, const uint8_t* literals, uint32_t literalCount, uint32_t offset, uint32_t length){
+    if(at + 1 + (literalCount / 255 + 1) + literalCount + 2 + (length / 255 + 1) > limit) return limit + 1;
+
+    uint32_t matchCode = length ? length - LZ_MIN_MATCH : 0;
+    out[at++] = (literalCount < 15 ? literalCount : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+    if(literalCount >= 15) at = lzPutLength(out, at, literalCount - 15);
+    memcpy(out + at, literals, literalCount);
+    at += literalCount;
+    if(length){
+        out[at++] = offset & 0xFF;
+        out[at++] = offset >> 8;
+        if(matchCode >= 15) at = lzPutLength(out, at, matchCode - 15);
+    }
+    return at;
+}
+
+// description:
+// - compresses a page with a greedy LZ77 pass: every position looks up the last one that started with the same
+//   4 bytes in a small hash table, and a match is extended 8 bytes at a time
+// arguments:
+// - in: the page
+// - out: receives the compressed page, at least limit bytes
+// - limit: the largest useful compressed size
+// returns:
+// - the compressed size, or 0 if it would exceed limit
+static uint32_t compressPage(const uint8_t* in, uint8_t* out, uint32_t limit){
+    uint16_t table[1 << LZ_HASH_BITS]; // Last position + 1 of each hashed 4-byte sequence, 0 if none
+    memset(table, 0, sizeof(table));
+    uint32_t at = 0;
+    uint32_t anchor = 0; // First byte not covered by a sequence yet
+    uint32_t position = 0;
+
+    while(position + LZ_MIN_MATCH <= 4096){
+        uint32_t sequence, previous;
+        memcpy(&sequence, in + position, 4);
+        uint32_t bucket = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[bucket];
+        table[bucket] = position + 1;
+        if(candidate == 0 || (memcpy(&previous, in + candidate - 1, 4), previous != sequence)){
+            position++;
+            continue;
+        }
+        candidate--;
+
+        uint32_t length = LZ_MIN_MATCH;
+        while(position + length + 8 <= 4096){
+            uint64_t a, b;
+            memcpy(&a, in + candidate + length, 8);
+            memcpy(&b, in + position + length, 8);
+            if(a != b){
+                length += __builtin_ctzll(a ^ b) / 8;
+                break;
+            }
+            length += 8;
+        }
+        while(position + length < 4096 && in[candidate + length] == in[position + length]) length++;
+
+        at = lzSequence(out, at, limit, in + anchor, position - anchor, position - candidate, length);
+        if(at > limit) return 0;
+        position += length;
+        anchor = position;
+    }
+    at = lzSequence(out, at, limit, in + anchor, 4096 - anchor, 0, 0);
+    return (at > limit) ? 0 : at;
+}
+
+// Will read the rest of a length written by lzPutLength, false if it runs past the end of the input.
+static bool lzGetLength(const uint8_t* in, uint32_t bytes, uint32_t* at, uint32_t* length){
+    for(;;){
+        if(*at >= bytes) return false;
+        uint8_t part = in[(*at)++];
+        *length += part;
+        if(part != 255) return true;
+    }
+}
+
+// description:
+// - decompresses a page written by compressPage, checking every length and offset against the buffers
+// arguments:
+// - in: the compressed page
+// - bytes: its size
+// - out: receives the page
+// returns:
+// - true on success, false if the input is corrupt
+static bool decompressPage(const uint8_t* in, uint32_t bytes, uint8_t* out){
+    uint32_t at = 0;
+    uint32_t position = 0;
+    while(at < bytes){
+        uint8_t token = in[at++];
+        uint32_t literalCount = token >> 4;
+        if(literalCount == 15 && !lzGetLength(in, bytes, &at, &literalCount)) return false;
+        if(literalCount > bytes - at || literalCount > 4096 - position) return false;
+        memcpy(out + position, in + at, literalCount);
+        at += literalCount;
+        position += literalCount;
+        if(at == bytes) break; // The last sequence has no match
+
+        if(bytes - at < 2) return false;
+        uint32_t offset = in[at] | (uint32_t)in[at + 1] << 8;
+        at += 2;
+        uint32_t length = token & 15;
+        if(length == 15 && !lzGetLength(in, bytes, &at, &length)) return false;
+        length += LZ_MIN_MATCH;
+        if(offset == 0 || offset > position || length > 4096 - position) return false;
+
+        // A match may overlap the bytes it produces (a run), those are copied one at a time
+        if(offset >= length) memcpy(out + position, out + position - offset, length);
+        else for(uint32_t i = 0; i < length; i++) out[position + i] = out[position + i - offset];
+        position += length;
+    }
+    return position == 4096;
+}
+
+// Will tell whether a page is one 64-bit value repeated, like a zeroed page.
+static bool pageFill(const void* page, uint64_t* fill){
+    const uint64_t* words = page;
+    uint64_t differ = 0;
+    for(uint32_t i = 1; i < 512; i++) differ |= words[i] ^ words[0];
+    *fill = words[0];
+    return differ == 0;
+}
+
+// Will return the entry holding a slot in the compressed pool, or ZSWAP_NONE.
+static uint32_t zswapFind(metadata* metaData, uint32_t slot){
+    if(metaData->zswapPool == NULL) return ZSWAP_NONE;
+    uint32_t entry = metaData->zswapBuckets[slot & metaData->zswapBucketMask];
+    while(entry != ZSWAP_NONE && metaData->zswapEntries[entry].slot != slot) entry = metaData->zswapEntries[entry].hashNext;
+    return entry;
+}
+
+// Will decompress the page of an entry of the compressed pool, false if it is corrupt.
+static bool zswapLoad(metadata* metaData, uint32_t entry, void* page){
+    zswapEntry* cached = &metaData->zswapEntries[entry];
+    if(cached->bytes == 0){
+        for(uint32_t i = 0; i < 512; i++) ((uint64_t*)page)[i] = cached->fill;
+        return true;
+    }
+    return decompressPage(metaData->zswapPool + (size_t)cached->firstUnit * ZSWAP_UNIT, cached->bytes, page);
+}
+
+// Will take an entry off its hash chain and the age list and free it with its units.
+static void zswapRemove(metadata* metaData, uint32_t entry){
+    zswapEntry* entries = metaData->zswapEntries;
+    uint32_t* link = &metaData->zswapBuckets[entries[entry].slot & metaData->zswapBucketMask];
+    while(*link != entry) link = &entries[*link].hashNext;
+    *link = entries[entry].hashNext;
+
+    if(entries[entry].older != ZSWAP_NONE) entries[entries[entry].older].newer = entries[entry].newer;
+    else metaData->zswapOldest = entries[entry].newer;
+    if(entries[entry].newer != ZSWAP_NONE) entries[entries[entry].newer].older = entries[entry].older;
+    else metaData->zswapNewest = entries[entry].older;
+
+    uint32_t units = (entries[entry].bytes + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+    for(uint32_t unit = entries[entry].firstUnit; unit < entries[entry].firstUnit + units; unit++){
+        hbitmapSet(&metaData->zswapFreeUnits, unit);
+    }
+    metaData->zswapPages--;
+    metaData->zswapBytes -= entries[entry].bytes;
+    entries[entry].hashNext = metaData->zswapFreeEntry;
+    metaData->zswapFreeEntry = entry;
+}
+
+// Will move the oldest page of the compressed pool to its slot in the swap file, in one write with the next
+// oldest pages as long as their slots follow on (pages evicted one after the other got consecutive slots).
+static vm_status_t zswapWriteBack(metadata* metaData){
+    uint8_t buffers[VM_SWAP_CLUSTER][4096];
+    void* pages[VM_SWAP_CLUSTER];
+    uint32_t entries[VM_SWAP_CLUSTER];
+    uint32_t count = 0;
+    uint32_t entry = metaData->zswapOldest;
+    do{
+        pages[count] = buffers[count];
+        if(!zswapLoad(metaData, entry, pages[count])) return VM_BAD_IO;
+        entries[count++] = entry;
+        entry = metaData->zswapEntries[entry].newer;
+    }while(count < VM_SWAP_CLUSTER && entry != ZSWAP_NONE && metaData->zswapEntries[entry].slot == metaData->zswapEntries[entries[count - 1]].slot + 1);
+
+    vm_status_t status = swapFileTransfer(metaData, metaData->zswapEntries[entries[0]].slot, pages, count, true);
+    for(uint32_t i = 0; status == VM_OK && i < count; i++) zswapRemove(metaData, entries[i]);
+    return status;
+}
+
+// description:
+// - keeps an evicted page in the compressed pool, as its fill value or LZ compressed
+// - makes room by writing the oldest pages of the pool back to the swap file
+// arguments:
+// - metaData: the VM system metadata
+// - slot: the swap slot of the page, which has no entry yet
+// - page: the page
+// returns:
+// - true if the pool holds the page, false if it goes to the swap file: it does not compress below
+//   ZSWAP_MAX_BYTES, or writing back an older page failed
+static bool zswapStore(metadata* metaData, uint32_t slot, const void* page){
+    uint8_t compressed[ZSWAP_MAX_BYTES];
+    uint64_t fill = 0;
+    uint32_t bytes = 0;
+    if(!pageFill(page, &fill)){
+        bytes = compressPage(page, compressed, ZSWAP_MAX_BYTES);
+        if(bytes == 0) return false;
+    }
+
+    uint32_t units = (bytes + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+    uint32_t firstUnit = 0;
+    while(metaData->zswapFreeEntry == ZSWAP_NONE || (units && !hbitmapFindRun(&metaData->zswapFreeUnits, units, 1, &firstUnit))){
+        if(metaData->zswapOldest == ZSWAP_NONE || zswapWriteBack(metaData) != VM_OK) return false;
+    }
+    for(uint32_t unit = firstUnit; unit < firstUnit + units; unit++){
+        hbitmapClear(&metaData->zswapFreeUnits, unit);
+    }
+    memcpy(metaData->zswapPool + (size_t)firstUnit * ZSWAP_UNIT, compressed, bytes);
+
+    uint32_t entry = metaData->zswapFreeEntry;
+    zswapEntry* cached = &metaData->zswapEntries[entry];
+    metaData->zswapFreeEntry = cached->hashNext;
+    cached->slot = slot;
+    cached->firstUnit = firstUnit;
+    cached->bytes = bytes;
+    cached->fill = fill;
+    cached->hashNext = metaData->zswapBuckets[slot & metaData->zswapBucketMask];
+    metaData->zswapBuckets[slot & metaData->zswapBucketMask] = entry;
+    cached->older = metaData->zswapNewest;
+    cached->newer = ZSWAP_NONE;
+    if(metaData->zswapNewest != ZSWAP_NONE) metaData->zswapEntries[metaData->zswapNewest].newer = entry;
+    else metaData->zswapOldest = entry;
+    metaData->zswapNewest = entry;
+    metaData->zswapPages++;
+    metaData->zswapBytes += bytes;
+    return true;
+}
+
+// Will return a swap slot to the free slots, dropping the copy of its page in the compressed pool if any.
+static void swapSlotFree(metadata* metaData, uint32_t slot){
+    uint32_t entry = zswapFind(metaData, slot);
+    if(entry != ZSWAP_NONE) zswapRemove(metaData, entry);
+    hbitmapSet(&metaData->swapSlotFree, slot);
+}
+
+// Will return the swap slot still holding a copy of a frame's page, if any, to the free slots.
+// Called with frameLock held; frameSlot is only read without it as a hint.
+static void dropSwapCopy(metadata* metaData, uint32_t frame){
+    uint32_t copy = metaData->frameSlot[frame];
+    if(copy == 0) return;
+    __atomic_store_n(&metaData->frameSlot[frame], 0, __ATOMIC_RELAXED);
+    metaData->swapCopies--;
+    swapSlotFree(metaData, copy - 1);
+}
+
+// Will drop the swap copy of every resident page, when the swap slots they hold are needed for evictions.
+// Returns the number of slots freed.
+static uint32_t dropSwapCopies(metadata* metaData){
+    uint32_t firstFrame = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    uint32_t dropped = 0;
+    for(uint32_t frame = firstFrame; frame < firstFrame + metaData->numPages; frame++){
+        if(metaData->frameSlot[frame] == 0) continue;
+        dropSwapCopy(metaData, frame);
+        dropped++;
+    }
+    return dropped;
+}
+
+// description:
+// - reads the page of a swap slot, from the compressed pool if it is there and from the swap file otherwise
+// - must be called with frameLock held when there is a pool
+// arguments:
+// - metaData: the VM system metadata
+// - slot: the swap slot
+// - page: receives the page
+// returns:
+// - VM_OK on success, VM_BAD_IO if the swap file could not be read or a compressed page is corrupt
+static vm_status_t swapRead(metadata* metaData, uint32_t slot, void* page){
+    uint32_t entry = zswapFind(metaData, slot);
+    if(entry != ZSWAP_NONE) return zswapLoad(metaData, entry, page) ? VM_OK : VM_BAD_IO;
+    return swapFileTransfer(metaData, slot, &page, 1, false);
+}
+
+// Will find a frame advised cold by vm_advise, for the eviction to take ahead of the clock, and clear its cold bit.
+// A page translated since the advice is no longer cold and is left to the clock. Called with frameLock held.
+static bool takeColdFrame(metadata* metaData, uint32_t* frame){
+    uint32_t words = (((uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart) / 4096 + 63) / 64;
+    uint32_t scanned = 0;
+    while(scanned <= words && __atomic_load_n(&metaData->coldPages, __ATOMIC_RELAXED) > 0){
+        uint32_t word = metaData->coldHand;
+        uint64_t bits = __atomic_load_n(&metaData->cold[word], __ATOMIC_RELAXED);
+        if(bits == 0){
+            metaData->coldHand = (word + 1 == words) ? 0 : word + 1;
+            scanned++;
+            continue;
+        }
+        uint32_t candidate = word * 64 + __builtin_ctzll(bits);
+        if(!clearCold(metaData, candidate)) continue;
+        if(__atomic_load_n(&metaData->referenced[word], __ATOMIC_RELAXED) & ((uint64_t)1 << (candidate % 64))) continue;
+        *frame = candidate;
+        return true;
+    }
+    return false;
+}
+
+// description:
+// - frees a physical page by writing a resident data page out to swap, chosen with the CLOCK policy
+// - pages translated since the clock hand last passed them get a second chance
+// - pages advised cold by vm_advise and not translated since go first, without moving the clock hand
+// - takes a cluster of up to VM_SWAP_CLUSTER victims with consecutive slots; those the compressed pool does not
+//   keep are written to the swap file a run of slots at a time. The victims past the first become free frames.
+// - a victim not written since it was swapped in still has its copy in the swap file and goes back to that slot
+//   without any I/O; one that was written gives up its old slot
+// arguments:
+// - metaData: the VM system metadata
+// - page: receives the freed physical page, still holding the evicted contents
+// returns:
+// - VM_OK if a page was freed
+// - VM_OUT_OF_MEM if there is no swap, no free swap slot or no resident data page
+// - VM_BAD_IO if writing the swap file failed
+static vm_status_t evictPage(metadata* metaData, void** page){
+    if(metaData->swapFile == NULL) return VM_OUT_OF_MEM;
+
+    uint32_t firstFrame = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    uint32_t endFrame = firstFrame + metaData->numPages;
+    uint32_t victims[VM_SWAP_CLUSTER];
+    uint32_t owners[VM_SWAP_CLUSTER];
+    uint32_t count = 0;
+    uint32_t clean[VM_SWAP_CLUSTER]; // Victims unchanged since their swap in, cleanSlots holds their copies
+    uint32_t cleanOwners[VM_SWAP_CLUSTER];
+    uint32_t cleanSlots[VM_SWAP_CLUSTER];
+    uint32_t cleanCount = 0;
+
+    // Two full turns are enough: the first one clears every second chance bit it passes
+    uint32_t scanned = 0;
+    while(scanned < 2 * metaData->numPages && count + cleanCount < VM_SWAP_CLUSTER){
+        uint32_t frame;
+        bool cold = takeColdFrame(metaData, &frame);
+        if(!cold){
+            frame = metaData->clockHand;
+            metaData->clockHand = (frame + 1 == endFrame) ? firstFrame : frame + 1;
+            scanned++;
+        }
+
+        uint32_t owner = __atomic_load_n(&metaData->frameOwner[frame], __ATOMIC_ACQUIRE);
+        if(owner == 0) continue;
+        if(!cold && (__atomic_load_n(&metaData->referenced[frame / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (frame % 64)))){
+            clearReferenced(metaData, frame);
+            continue;
+        }
+
+        // Claim the page by clearing its owner, vm_unmap_page may be releasing it without frameLock
+        if(!__atomic_compare_exchange_n(&metaData->frameOwner[frame], &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) continue;
+        uint32_t copy = metaData->frameSlot[frame];
+        if(copy != 0 && !testWritten(metaData, frame)){
+            __atomic_store_n(&metaData->frameSlot[frame], 0, __ATOMIC_RELAXED);
+            metaData->swapCopies--;
+            clean[cleanCount] = frame;
+            cleanOwners[cleanCount] = owner;
+            cleanSlots[cleanCount] = copy - 1;
+            cleanCount++;
+            continue;
+        }
+        dropSwapCopy(metaData, frame);
+        victims[count] = frame;
+        owners[count] = owner;
+        count++;
+    }
+    if(count + cleanCount == 0) return VM_OUT_OF_MEM;
+
+    // Fewer victims if no run of slots is long enough for all of them.
+    // The slots kept by resident pages are given up first, they only save writes.
+    uint32_t slot = 0;
+    bool dropped = false;
+    while(count > 0 && !swapSlotAlloc(metaData, count, &slot)){
+        if(!dropped){
+            dropped = true;
+            if(dropSwapCopies(metaData) > 0) continue;
+        }
+        count--;
+        __atomic_store_n(&metaData->frameOwner[victims[count]], owners[count], __ATOMIC_RELEASE);
+    }
+    if(count + cleanCount == 0) return VM_OUT_OF_MEM;
+
+    void* pages[VM_SWAP_CLUSTER];
+    for(uint32_t i = 0; i < count; i++){
+        pages[i] = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)victims[i] << 12));
+    }
+    bool evicted[VM_SWAP_CLUSTER];
+    for(uint32_t i = 0; i < count; i++){
+        evicted[i] = metaData->zswapPool != NULL && zswapStore(metaData, slot + i, pages[i]);
+    }
+    for(uint32_t i = 0; i < count; i++){
+        if(evicted[i]) continue;
+        uint32_t end = i + 1;
+        while(end < count && !evicted[end]) end++;
+        bool written = swapFileTransfer(metaData, slot + i, pages + i, end - i, true) == VM_OK;
+        for(uint32_t j = i; j < end; j++) evicted[j] = written;
+        i = end - 1;
+    }
+
+    // Point the PTEs at the swap slots, keeping their permissions. The victims may belong to any address
+    // space, so lock-free readers learn about them from evictSeq rather than from their space's lock.
+    // Victims that could not be written keep their frame.
+    *page = NULL;
+    uint32_t evictions = 0;
+    beginRemoval(&metaData->evictSeq);
+    for(uint32_t i = 0; i < count; i++){
+        if(!evicted[i]){
+            swapSlotFree(metaData, slot + i);
+            __atomic_store_n(&metaData->frameOwner[victims[i]], owners[i], __ATOMIC_RELEASE);
+            continue;
+        }
+        uint32_t* pageTableEntry = (uint32_t*)((uintptr_t)metaData->vmStart + owners[i]);
+        storeEntry(pageTableEntry, ((slot + i) << PTE_SLOT_SHIFT) | (*pageTableEntry & PTE_PERMS) | PTE_VALID);
+        tlbInvalidateFrame(metaData, victims[i]);
+        clearAccessBits(metaData, victims[i]);
+        if(*page == NULL) *page = pages[i];
+        else addDirtyPage(metaData, pages[i]);
+        evictions++;
+    }
+    for(uint32_t i = 0; i < cleanCount; i++){
+        uint32_t* pageTableEntry = (uint32_t*)((uintptr_t)metaData->vmStart + cleanOwners[i]);
+        void* cleanPage = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)clean[i] << 12));
+        storeEntry(pageTableEntry, (cleanSlots[i] << PTE_SLOT_SHIFT) | (*pageTableEntry & PTE_PERMS) | PTE_VALID);
+        tlbInvalidateFrame(metaData, clean[i]);
+        clearAccessBits(metaData, clean[i]);
+        if(*page == NULL) *page = cleanPage;
+        else addDirtyPage(metaData, cleanPage);
+    }
+    endRemoval(&metaData->evictSeq);
+    __atomic_fetch_add(&metaData->evictions, evictions + cleanCount, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metaData->cleanEvictions, cleanCount, __ATOMIC_RELAXED);
+    return (*page != NULL) ? VM_OK : VM_BAD_IO;
+}
+
+// description:
+// - allocates a physical page, evicting a data page to swap if none is free
+// - must be called with frameLock held, like every function that uses the free frames or swap slots
+// arguments:
+// - metaData: the VM system metadata
+// - zeroed: the page must be all zero; callers that overwrite the whole page pass false to skip the clear
+// - status: receives VM_OK, or why no page could be allocated (VM_OUT_OF_MEM or VM_BAD_IO)
+// returns:
+// - the page, or NULL on failure
+static void* allocPage(metadata* metaData, bool zeroed, vm_status_t* status){
+    void* page = takeFreePage(metaData, zeroed);
+    if(page != NULL){
+        *status = VM_OK;
+        return page;
+    }
+
+    *status = evictPage(metaData, &page);
+    if(page != NULL && zeroed) memset(page, 0, 4096);
+    return page;
+}
+
+// Will find the magazine of the calling thread, threads that hash to the same one share it.
+static magazine* getMagazine(metadata* metaData){
+    uint64_t thread = (uint64_t)(uintptr_t)pthread_self();
+    return &metaData->magazines[((thread * 0x9E3779B97F4A7C15ull) >> 40) & (metaData->numMagazines - 1)];
+}
+
+// Will move the oldest count frames of a magazine back to the free frames.
+// Called with the magazine's lock and frameLock held.
+static void flushMagazine(metadata* metaData, magazine* cache, uint32_t count){
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t slot = cache->frames[i];
+        hbitmapSet((slot & MAGAZINE_ZEROED) ? &metaData->zeroedFrames : &metaData->dirtyFrames, slot & ~MAGAZINE_ZEROED);
+    }
+    cache->count -= count;
+    memmove(cache->frames, cache->frames + count, cache->count * sizeof(uint32_t));
+}
+
+// Will return every frame cached in the magazines to the free frames, before memory counts as exhausted.
+// Must be called without frameLock held.
+static void drainMagazines(metadata* metaData){
+    for(uint32_t i = 0; i < metaData->numMagazines; i++){
+        magazine* cache = &metaData->magazines[i];
+        pthread_mutex_lock(&cache->lock);
+        pthread_mutex_lock(&metaData->frameLock);
+        flushMagazine(metaData, cache, cache->count);
+        pthread_mutex_unlock(&metaData->frameLock);
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+// description:
+// - allocates a physical page from the calling thread's magazine, refilling it from the free frames in one batch
+// - pages that must be zeroed but come out dirty are cleared after every lock is released
+// - only once the free frames and all the magazines are empty does it fall back to allocPage, and so to eviction
+// - must be called without frameLock held
+// arguments:
+// - metaData: the VM system metadata
+// - zeroed: the page must be all zero
+// - status: receives VM_OK, or why no page could be allocated (VM_OUT_OF_MEM or VM_BAD_IO)
+// returns:
+// - the page, or NULL on failure
+static void* allocFrame(metadata* metaData, bool zeroed, vm_status_t* status){
+    uint32_t slot = 0;
+    bool found = false;
+
+    if(metaData->numMagazines){
+        magazine* cache = getMagazine(metaData);
+        pthread_mutex_lock(&cache->lock);
+        if(cache->count == 0){
+            // Refill half the magazine, preferring zeroed frames, and leave the zeroed ones on top
+            uint32_t frame;
+            pthread_mutex_lock(&metaData->frameLock);
+            while(cache->count < (VM_MAGAZINE_SIZE + 1) / 2 && hbitmapNext(&metaData->zeroedFrames, 0, &frame)){
+                hbitmapClear(&metaData->zeroedFrames, frame);
+                cache->frames[cache->count++] = frame | MAGAZINE_ZEROED;
+            }
+            while(cache->count < (VM_MAGAZINE_SIZE + 1) / 2 && hbitmapNext(&metaData->dirtyFrames, 0, &frame)){
+                hbitmapClear(&metaData->dirtyFrames, frame);
+                cache->frames[cache->count++] = frame;
+            }
+            pthread_mutex_unlock(&metaData->frameLock);
+            for(uint32_t i = 0; i < cache->count / 2; i++){
+                uint32_t top = cache->frames[cache->count - 1 - i];
+                cache->frames[cache->count - 1 - i] = cache->frames[i];
+                cache->frames[i] = top;
+            }
+        }
+        if(cache->count){
+            slot = cache->frames[--cache->count];
+            found = true;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    if(found){
+        void* page = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)(slot & ~MAGAZINE_ZEROED) << 12));
+        if(zeroed && !(slot & MAGAZINE_ZEROED)) memset(page, 0, 4096);
+        *status = VM_OK;
+        return page;
+    }
+
+    // Nothing is free nearby: bring back what other threads cache, and evict if that is not enough
+    drainMagazines(metaData);
+    pthread_mutex_lock(&metaData->frameLock);
+    void* page = allocPage(metaData, zeroed, status);
+    pthread_mutex_unlock(&metaData->frameLock);
+    return page;
+}
+
+// description:
+// - returns a physical page to the calling thread's magazine, moving its older half to the free frames when it is full
+// - must be called without frameLock held
+// arguments:
+// - metaData: the VM system metadata
+// - page: the physical page
+// - zeroed: the page is all zero
+static void freeFrame(metadata* metaData, void* page, bool zeroed){
+    uint32_t frame = ((uintptr_t)page - (uintptr_t)metaData->vmStart) >> 12;
+
+    if(!metaData->numMagazines){
+        pthread_mutex_lock(&metaData->frameLock);
+        hbitmapSet(zeroed ? &metaData->zeroedFrames : &metaData->dirtyFrames, frame);
+        pthread_mutex_unlock(&metaData->frameLock);
+        return;
+    }
+
+    magazine* cache = getMagazine(metaData);
+    pthread_mutex_lock(&cache->lock);
+    if(cache->count == VM_MAGAZINE_SIZE){
+        pthread_mutex_lock(&metaData->frameLock);
+        flushMagazine(metaData, cache, (VM_MAGAZINE_SIZE + 1) / 2);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    cache->frames[cache->count++] = frame | (zeroed ? MAGAZINE_ZEROED : 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Will clear a valid L2 entry and release whatever it mapped: its physical page if resident, its swap slot if swapped out.
+// A shared page only loses a reference, it is freed with its last mapping.
+// The entry is read with frameLock held, so an eviction cannot move the page to swap in between.
+static void releaseMapping(metadata* metaData, uint32_t* secondLevelEntry){
+    uint32_t pageTableEntry = *secondLevelEntry;
+    storeEntry(secondLevelEntry, 0);
+    if(pageTableEntry & PTE_PRESENT){
+        uint32_t frame = pageTableEntry >> 12;
+        if(metaData->frameRefs[frame] & FRAME_REFS){
+            metaData->frameRefs[frame]--;
+            return;
+        }
+        metaData->frameRefs[frame] = 0;
+        void* physicalPage = (void*)((uintptr_t)metaData->vmStart + (pageTableEntry & PTE_FRAME));
+        addDirtyPage(metaData, physicalPage);
+        __atomic_store_n(&metaData->frameOwner[frame], 0, __ATOMIC_RELAXED);
+        clearAccessBits(metaData, frame);
+        dropSwapCopy(metaData, frame);
+    }else if(!reservedEntry(pageTableEntry)){
+        swapSlotFree(metaData, pageTableEntry >> PTE_SLOT_SHIFT);
+    }
+}
+
+// description:
+// - writes an L1 entry, keeping the occupancy bitmap of its table in sync
+// - bit g of the bitmap is set while one of the entries 32g..32g+31 (two cache lines) is valid
+// arguments:
+// - metaData: the VM system metadata
+// - firstLevelEntry: the L1 entry to write
+// - value: the new value of the entry
+static void setFirstLevelEntry(metadata* metaData, uint32_t* firstLevelEntry, uint32_t value){
+    uintptr_t entryAddress = (uintptr_t)firstLevelEntry - (uintptr_t)metaData->vmStart;
+    uint32_t index = (entryAddress & 0xFFF) / 4;
+    uint32_t* occupancy = &metaData->frameCount[entryAddress >> 12];
+
+    storeEntry(firstLevelEntry, value);
+    if(value & PTE_VALID){
+        *occupancy |= (uint32_t)1 << (index / 32);
+        return;
+    }
+
+    // Only clear the bit once no entry of the group is valid
+    uint32_t* group = firstLevelEntry - (index % 32);
+    for(int i = 0; i < 32; i++){
+        if(group[i] & PTE_VALID) return;
+    }
+    *occupancy &= ~((uint32_t)1 << (index / 32));
+}
+
+// Will return the 1024 frames of a superpage to the free frames, they are zeroed later.
+static void releaseSuperpage(metadata* metaData, uint32_t firstLevelEntry){
+    void* firstPage = (void*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_SUPER_FRAME));
+    for(uint32_t i = 0; i < 1024; i++){
+        addDirtyPage(metaData, (void*)((uintptr_t)firstPage + i * 4096));
+        clearAccessBits(metaData, (firstLevelEntry >> 12) + i);
+    }
+}
+
+// description:
+// - turns a superpage into an L2 table of 1024 reserved pages with its permissions, for VM_ADVICE_DONTNEED
+// - the first frame of the superpage becomes the table, so nothing is allocated; the other 1023 are freed
+// - called with frameLock held, and within beginRemoval / endRemoval of the address space
+// arguments:
+// - metaData: the VM system metadata
+// - firstLevelEntry: the L1 entry of the superpage, rewritten to point at the new L2 table
+static void reserveSuperpage(metadata* metaData, uint32_t* firstLevelEntry){
+    uint32_t superpage = *firstLevelEntry;
+    uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (superpage & PTE_SUPER_FRAME));
+    uint32_t reserved = ((uint32_t)PTE_ZERO_SLOT << PTE_SLOT_SHIFT) | (superpage & PTE_PERMS) | PTE_VALID;
+    for(uint32_t i = 0; i < 1024; i++){
+        secondLevelTable[i] = reserved;
+    }
+    metaData->frameCount[superpage >> 12] = 1024;
+    setFirstLevelEntry(metaData, firstLevelEntry, (superpage & PTE_SUPER_FRAME) | PTE_VALID | PTE_PRESENT);
+    clearAccessBits(metaData, superpage >> 12);
+    for(uint32_t i = 1; i < 1024; i++){
+        addDirtyPage(metaData, (char*)secondLevelTable + i * 4096);
+        clearAccessBits(metaData, (superpage >> 12) + i);
+    }
+}
+
+// description:
+// - turns a superpage into an L2 table of 1024 ordinary pages with the same frames and permissions
+// - the pages become evictable like any other data page, once the table is in place
+// arguments:
+// - metaData: the VM system metadata
+// - firstLevelEntry: the L1 entry of the superpage, rewritten to point at the new L2 table
+// - secondLevelTable: a free page for the L2 table, every entry of it is written
+static void splitSuperpage(metadata* metaData, uint32_t* firstLevelEntry, uint32_t* secondLevelTable){
+    uintptr_t tableAddress = (uintptr_t)secondLevelTable - (uintptr_t)metaData->vmStart;
+    for(uint32_t i = 0; i < 1024; i++){
+        secondLevelTable[i] = superpageEntry(*firstLevelEntry, i);
+    }
+    metaData->frameCount[tableAddress >> 12] = 1024;
+    setFirstLevelEntry(metaData, firstLevelEntry, (tableAddress & PTE_FRAME) | PTE_VALID | PTE_PRESENT);
+    for(uint32_t i = 0; i < 1024; i++){
+        __atomic_store_n(&metaData->frameOwner[secondLevelTable[i] >> 12], tableAddress + i * 4, __ATOMIC_RELEASE);
+    }
+}
+
+// description:
+// - frees the L2 table behind an L1 entry if none of its entries is valid any more
+// - invalid entries are always 0, so an empty table is already zeroed
+// - lock-free readers may still be walking the table, so callers bracket this with beginRemoval / endRemoval
+// arguments:
+// - metaData: the VM system metadata
+// - firstLevelEntry: the L1 entry pointing at the table, cleared if the table is freed
+// returns:
+// - true if the table was freed
+static bool releaseTableIfEmpty(metadata* metaData, uint32_t* firstLevelEntry){
+    if(metaData->frameCount[*firstLevelEntry >> 12] != 0) return false;
+
+    // Free second level page
+    addFreePage(metaData, (void*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME)));
+    setFirstLevelEntry(metaData, firstLevelEntry, 0);
+    return true;
+}
+
+// Will tell whether an L2 entry is swapped out to a given slot of the swap file (not to the compressed pool).
+static bool swappedToFile(metadata* metaData, uint32_t pageTableEntry, uint32_t slot){
+    return (pageTableEntry & (PTE_VALID | PTE_PRESENT)) == PTE_VALID && !reservedEntry(pageTableEntry) && pageTableEntry >> PTE_SLOT_SHIFT == slot && zswapFind(metaData, slot) == ZSWAP_NONE;
+}
+
+// Will give a page reserved by vm_reserve_page / vm_reserve_range a zeroed physical page, see swapIn.
+static vm_status_t fillReserved(metadata* metaData, uint32_t* pageTableEntry){
+    vm_status_t status;
+    void* page = allocPage(metaData, true, &status);
+    if(page == NULL) return status;
+
+    uintptr_t physicalAddress = (uintptr_t)page - (uintptr_t)metaData->vmStart;
+    storeEntry(pageTableEntry, (physicalAddress & PTE_FRAME) | (*pageTableEntry & PTE_PERMS) | PTE_VALID | PTE_PRESENT);
+    __atomic_store_n(&metaData->frameOwner[physicalAddress >> 12], (uintptr_t)pageTableEntry - (uintptr_t)metaData->vmStart, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&metaData->zeroFills, 1, __ATOMIC_RELAXED);
+    return VM_OK;
+}
+
+// description:
+// - brings a swapped out page back into physical memory
+// - a page reserved by vm_reserve_page / vm_reserve_range gets a zeroed page instead, nothing is read
+// - a page read from the swap file keeps its slot, so that evicting it again before it is written costs no I/O
+// - a page read from the swap file brings along the entries next to it in its L2 table whose pages sit in the
+//   slots next to its own, as long as free frames are at hand: they were swapped out together and are likely
+//   to be wanted together. All of them are read in one call, up to VM_SWAP_CLUSTER pages.
+// arguments:
+// - metaData: the VM system metadata
+// - pageTableEntry: the L2 entry of the page, valid but not present
+// - cluster: bring along the neighbouring pages, false where vm_advise marked the range random
+// returns:
+// - VM_OK if the page is now resident and the entry points at it
+// - VM_OUT_OF_MEM if no physical page could be freed for it
+// - VM_BAD_IO if accessing the swap file failed
+static vm_status_t swapIn(metadata* metaData, uint32_t* pageTableEntry, bool cluster){
+    if(reservedEntry(*pageTableEntry)) return fillReserved(metaData, pageTableEntry);
+
+    uint32_t slot = *pageTableEntry >> PTE_SLOT_SHIFT;
+    vm_status_t status;
+    void* page = allocPage(metaData, false, &status);
+    if(page == NULL) return status;
+
+    // frames[VM_SWAP_CLUSTER + k] receives the page of the entry k places after this one
+    uintptr_t entryOffset = (uintptr_t)pageTableEntry - (uintptr_t)metaData->vmStart;
+    uint32_t* table = (uint32_t*)((uintptr_t)metaData->vmStart + (entryOffset & ~(uintptr_t)4095));
+    uint32_t index = (entryOffset & 4095) / 4;
+    uint32_t first = index, last = index;
+    void* frames[2 * VM_SWAP_CLUSTER];
+    frames[VM_SWAP_CLUSTER] = page;
+    bool fromFile = zswapFind(metaData, slot) == ZSWAP_NONE;
+    if(fromFile && cluster){
+        while(last - first + 1 < VM_SWAP_CLUSTER && last + 1 < 1024 && swappedToFile(metaData, table[last + 1], slot + last + 1 - index)){
+            if((frames[VM_SWAP_CLUSTER + last + 1 - index] = takeFreePage(metaData, false)) == NULL) break;
+            last++;
+        }
+        while(last - first + 1 < VM_SWAP_CLUSTER && first > 0 && index - first + 1 <= slot && swappedToFile(metaData, table[first - 1], slot - (index - first + 1))){
+            if((frames[VM_SWAP_CLUSTER - (index - first + 1)] = takeFreePage(metaData, false)) == NULL) break;
+            first--;
+        }
+    }
+    void** pages = &frames[VM_SWAP_CLUSTER - (index - first)];
+    uint32_t count = last - first + 1;
+    uint32_t firstSlot = slot - (index - first);
+
+    status = (count == 1) ? swapRead(metaData, slot, page) : swapFileTransfer(metaData, firstSlot, pages, count, false);
+    if(status != VM_OK){
+        for(uint32_t i = 0; i < count; i++) addDirtyPage(metaData, pages[i]);
+        return VM_BAD_IO;
+    }
+
+    for(uint32_t i = 0; i < count; i++){
+        uint32_t* entry = &table[first + i];
+        uintptr_t physicalAddress = (uintptr_t)pages[i] - (uintptr_t)metaData->vmStart;
+        clearAccessBits(metaData, physicalAddress >> 12);
+        if(fromFile){
+            __atomic_store_n(&metaData->frameSlot[physicalAddress >> 12], firstSlot + i + 1, __ATOMIC_RELAXED);
+            metaData->swapCopies++;
+        }else{
+            swapSlotFree(metaData, firstSlot + i);
+        }
+        storeEntry(entry, (physicalAddress & PTE_FRAME) | (*entry & PTE_PERMS) | PTE_VALID | PTE_PRESENT);
+        __atomic_store_n(&metaData->frameOwner[physicalAddress >> 12], (uintptr_t)entry - (uintptr_t)metaData->vmStart, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&metaData->swapIns, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metaData->swapReadahead, count - 1, __ATOMIC_RELAXED);
+    return VM_OK;
+}
+
+// Will bring in the pages after a faulting one in its L2 table, for a range vm_advise marked sequential.
+// Stops at the first entry that is not mapped, on an error, or once no free frame is left.
+// Called with the address space and frameLock held.
+static void readAhead(metadata* metaData, uint32_t* pageTableEntry){
+    uintptr_t entryOffset = (uintptr_t)pageTableEntry - (uintptr_t)metaData->vmStart;
+    uint32_t* table = (uint32_t*)((uintptr_t)metaData->vmStart + (entryOffset & ~(uintptr_t)4095));
+    uint32_t index = (entryOffset & 4095) / 4;
+    uint32_t end = (index + 1 + VM_SEQUENTIAL_READAHEAD < 1024) ? index + 1 + VM_SEQUENTIAL_READAHEAD : 1024;
+    uint32_t frame;
+    for(uint32_t i = index + 1; i < end; i++){
+        if(!(table[i] & PTE_VALID)) break;
+        if(table[i] & PTE_PRESENT) continue;
+        if(!hbitmapNext(&metaData->zeroedFrames, 0, &frame) && !hbitmapNext(&metaData->dirtyFrames, 0, &frame)) break;
+        if(swapIn(metaData, &table[i], true) != VM_OK) break;
+        __atomic_fetch_add(&metaData->prefetches, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#if VM_PAGE_TABLE_LEVELS == 4
+// description:
+// - finds the root table of the 4 GiB region of addr, the top-level table of the 2-level page table that maps it
+// - takes no lock: directories and region roots, once created, stay until the address space is destroyed
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level directory of the address space
+// - addr: a virtual address in the region
+// returns:
+// - the physical address of the root table of the region, 0 if the region has none or addr is beyond 48 bits
+static paddr_t findRegion(metadata* metaData, paddr_t pt, vaddr_t addr){
+    uint32_t physicalSize = (uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart;
+    if(addr >> 48) return 0;
+
+    uint32_t directoryEntry = loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + pt) + (addr >> 42));
+    if(!(directoryEntry & PTE_VALID) || (directoryEntry & PTE_FRAME) >= physicalSize) return 0;
+    uint32_t regionEntry = loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + (directoryEntry & PTE_FRAME)) + ((addr >> 32) & 0x3FF));
+    if(!(regionEntry & PTE_VALID) || (regionEntry & PTE_FRAME) >= physicalSize) return 0;
+    return regionEntry & PTE_FRAME;
+}
+
+// description:
+// - finds the root table of the region of addr like findRegion, creating it and the directory above it if needed
+// - takes the lock of the address space at pt, so the caller must not hold the lock of any of its regions
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level directory of the address space
+// - addr: a virtual address in the region
+// - status: receives VM_OK, VM_BAD_ADDR if addr is beyond 48 bits, or why no table could be allocated
+// returns:
+// - the physical address of the root table of the region, 0 on failure
+static paddr_t makeRegion(metadata* metaData, paddr_t pt, vaddr_t addr, vm_status_t* status){
+    *status = (addr >> 48) ? VM_BAD_ADDR : VM_OK;
+    if(*status != VM_OK) return 0;
+    paddr_t root = findRegion(metaData, pt, addr);
+    if(root != 0) return root;
+
+    // Tables are published zeroed, lock-free readers may find them as soon as their entry is stored
+    spaceLock* space = getSpaceLock(metaData, pt);
+    pthread_mutex_lock(&space->lock);
+    uint32_t* entry = (uint32_t*)((uintptr_t)metaData->vmStart + pt) + (addr >> 42);
+    for(uint32_t level = 0; level < 2; level++){
+        if(!(*entry & PTE_VALID)){
+            void* table = allocFrame(metaData, true, status);
+            if(table == NULL) break;
+            uintptr_t tableAddress = (uintptr_t)table - (uintptr_t)metaData->vmStart;
+            metaData->frameCount[tableAddress >> 12] = 0;
+            storeEntry(entry, (tableAddress & PTE_FRAME) | PTE_VALID | PTE_PRESENT);
+        }
+        if(level == 0) entry = (uint32_t*)((uintptr_t)metaData->vmStart + (*entry & PTE_FRAME)) + ((addr >> 32) & 0x3FF);
+        else root = *entry & PTE_FRAME;
+    }
+    pthread_mutex_unlock(&space->lock);
+    return root;
+}
+
+// Will free the directories of the address space at pt once all its regions are destroyed, the top-level one last.
+static void releaseDirectories(metadata* metaData, paddr_t pt){
+    uint32_t* topDirectory = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    pthread_mutex_lock(&metaData->frameLock);
+    for(uint32_t i = 0; i < 64; i++){
+        if(!(topDirectory[i] & PTE_VALID)) continue;
+        void* directory = (void*)((uintptr_t)metaData->vmStart + (topDirectory[i] & PTE_FRAME));
+        memset(directory, 0, 4096);
+        addFreePage(metaData, directory);
+        topDirectory[i] = 0;
+    }
+    addFreePage(metaData, topDirectory);
+    pthread_mutex_unlock(&metaData->frameLock);
+}
+
+// Will tell whether [addr, addr + len) lies within the 48 bits of the virtual address space.
+static bool rangeInSpace(vaddr_t addr, size_t len){
+    return !(addr >> 48) && (uint64_t)len <= ((vaddr_t)1 << 48) - addr;
+}
+
+// Will split [addr, addr + len) at the end of the region of addr, returning the length of the part in it.
+static size_t regionChunk(vaddr_t addr, size_t len){
+    size_t left = ((vaddr_t)1 << 32) - regionOffset(addr);
+    return (len < left) ? len : left;
+}
+#endif
+
+// Will find the first region numbered *region or above that has a root table, region n holding the addresses
+// n << 32 to (n << 32) + 0xFFFFFFFF. Returns its root table and leaves its number in *region, or returns 0 once
+// there is none left. With 2-level page tables, region 0 is the whole address space and pt its root table.
+static paddr_t nextRegion(metadata* metaData, paddr_t pt, uint32_t* region){
+#if VM_PAGE_TABLE_LEVELS == 4
+    uint32_t* topDirectory = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    for(; *region < 64 * 1024; (*region)++){
+        uint32_t directoryEntry = loadEntry(&topDirectory[*region >> 10]);
+        if(!(directoryEntry & PTE_VALID)){
+            *region |= 0x3FF;
+            continue;
+        }
+        uint32_t regionEntry = loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + (directoryEntry & PTE_FRAME)) + (*region & 0x3FF));
+        if(regionEntry & PTE_VALID) return regionEntry & PTE_FRAME;
+    }
+    return 0;
+#else
+    (void)metaData;
+    return (*region == 0) ? pt : 0;
+#endif
+}
+
+// Will count the directory pages above the regions of the address space at pt, none with 2-level page tables.
+static uint32_t directoryPages(metadata* metaData, paddr_t pt){
+    uint32_t pages = 0;
+#if VM_PAGE_TABLE_LEVELS == 4
+    uint32_t* topDirectory = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    pages = 1;
+    for(uint32_t i = 0; i < 64; i++){
+        if(loadEntry(&topDirectory[i]) & PTE_VALID) pages++;
+    }
+#else
+    (void)metaData;
+    (void)pt;
+#endif
+    return pages;
+}
+
+// Will move pt and addr from the address space to the region of addr: its root table and the offset in it.
+// A missing region is created if create is set, and is VM_BAD_ADDR otherwise. Nothing changes with 2-level
+// page tables.
+static vm_status_t enterRegion(metadata* metaData, paddr_t* pt, vaddr_t* addr, bool create){
+#if VM_PAGE_TABLE_LEVELS == 4
+    vm_status_t status = VM_BAD_ADDR;
+    paddr_t root = create ? makeRegion(metaData, *pt, *addr, &status) : findRegion(metaData, *pt, *addr);
+    if(root == 0) return status;
+    *pt = root;
+    *addr = regionOffset(*addr);
+#else
+    (void)metaData;
+    (void)pt;
+    (void)addr;
+    (void)create;
+#endif
+    return VM_OK;
+}
+
+// description:
+// - walks the page table without taking any lock
+// - the result is only meaningful if no writer of the address space ran meanwhile (see vm_translate);
+//   a table freed under the walk may hold anything, so no pointer read from it leaves physical memory
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level page table
+// - addr: the virtual address that is to be translated
+// returns:
+// - the L2 entry of addr (the equivalent entry for a superpage), 0 if there is none
+static uint32_t walkPageTable(metadata* metaData, paddr_t pt, vaddr_t addr){
+    uint32_t firstLevelEntry = loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + pt + getFirstLevel(addr)*4));
+    if(!(firstLevelEntry & PTE_VALID)) return 0;
+
+    // A superpage maps the whole 4 MiB region, the walk ends here
+    if(firstLevelEntry & PTE_LARGE) return superpageEntry(firstLevelEntry, getSecondLevel(addr));
+
+    if((firstLevelEntry & PTE_FRAME) >= (uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart) return 0;
+    return loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME) + getSecondLevel(addr)*4));
+}
+
+// description:
+// - walks the page table with the address space and frameLock held, bringing a swapped out page back in
+// - the fallback of vm_translate when the lock-free walk raced with a writer or found a swapped out page
+// arguments:
+// - metaData: the VM system metadata
+// - space: the lock of the address space
+// - pt: physical address of the top-level page table
+// - addr: the virtual address that is to be translated
+// - required: the PTE bits the access needs, a swapped out page that lacks them is left in swap
+// - pageTableEntry: receives the L2 entry of addr (the equivalent entry for a superpage), 0 if there is none
+// returns:
+// - VM_OK, or why a swapped out page could not be brought in (VM_OUT_OF_MEM or VM_BAD_IO)
+static vm_status_t translateLocked(metadata* metaData, spaceLock* space, paddr_t pt, vaddr_t addr, uint32_t required, uint32_t* pageTableEntry){
+    vm_status_t status = VM_OK;
+    pthread_mutex_lock(&space->lock);
+    pthread_mutex_lock(&metaData->frameLock);
+
+    *pageTableEntry = walkPageTable(metaData, pt, addr);
+
+    // Bring a swapped out page back in, unless the access would be refused anyway.
+    // Only L2 entries are ever swapped out, so the L1 entry points at a table.
+    if((*pageTableEntry & (PTE_VALID | PTE_PRESENT)) == PTE_VALID && (*pageTableEntry & required) == required){
+        uint32_t firstLevelEntry = *(uint32_t*)((uintptr_t)metaData->vmStart + pt + getFirstLevel(addr)*4);
+        uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME) + getSecondLevel(addr)*4);
+        status = swapIn(metaData, secondLevelEntry, !(firstLevelEntry & PTE_RANDOM));
+        if(status == VM_OK && (firstLevelEntry & PTE_SEQUENTIAL)) readAhead(metaData, secondLevelEntry);
+        *pageTableEntry = *secondLevelEntry;
+    }
+
+    // Nothing can change the entry while both locks are held, so it is safe to cache.
+    // Copy-on-write entries are never cached, the TLB has no room for the bit that tells them apart.
+    if(status == VM_OK && (*pageTableEntry & (PTE_PRESENT | PTE_COW)) == PTE_PRESENT) tlbInsert(metaData, pt, addr, *pageTableEntry);
+
+    pthread_mutex_unlock(&metaData->frameLock);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+}
+
+// description:
+// - gives the writer of a copy-on-write page a page of its own
+// - the last mapping of a page that is no longer shared just gets its write permission back
+// - takes the lock of the address space and frameLock itself
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level page table
+// - addr: the virtual address being written
+// returns:
+// - VM_OK if the page of addr is now writable
+// - VM_BAD_PERM if it is not a copy-on-write page (any more)
+// - VM_OUT_OF_MEM / VM_BAD_IO if no page could be allocated for the copy
+static vm_status_t breakCopyOnWrite(metadata* metaData, paddr_t pt, vaddr_t addr){
+    spaceLock* space = getSpaceLock(metaData, pt);
+    vm_status_t status;
+
+    // The copy is allocated first, a magazine cannot be used with frameLock held
+    void* copy = allocFrame(metaData, false, &status);
+    if(copy == NULL) return status;
+
+    pthread_mutex_lock(&space->lock);
+    pthread_mutex_lock(&metaData->frameLock);
+    status = VM_BAD_PERM;
+
+    uint32_t firstLevelEntry = *(uint32_t*)((uintptr_t)metaData->vmStart + pt + getFirstLevel(addr)*4);
+    uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME) + getSecondLevel(addr)*4);
+    if((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == PTE_VALID && (*secondLevelEntry & (PTE_VALID | PTE_PRESENT | PTE_COW)) == (PTE_VALID | PTE_PRESENT | PTE_COW)){
+        uint32_t pageTableEntry = *secondLevelEntry;
+        uint32_t frame = pageTableEntry >> 12;
+        uintptr_t owner = (uintptr_t)secondLevelEntry - (uintptr_t)metaData->vmStart;
+
+        // Readers of the old frame must not keep using it once it belongs to another address space
+        beginRemoval(&space->seq);
+        if(metaData->frameRefs[frame] == 0){
+            storeEntry(secondLevelEntry, (pageTableEntry & ~PTE_COW) | PTE_WRITE);
+            __atomic_store_n(&metaData->frameOwner[frame], owner, __ATOMIC_RELEASE);
+        }else{
+            uintptr_t physicalAddress = (uintptr_t)copy - (uintptr_t)metaData->vmStart;
+            memcpy(copy, (void*)((uintptr_t)metaData->vmStart + (pageTableEntry & PTE_FRAME)), 4096);
+            metaData->frameRefs[frame]--;
+            storeEntry(secondLevelEntry, (physicalAddress & PTE_FRAME) | (pageTableEntry & PTE_PERMS) | PTE_WRITE | PTE_VALID | PTE_PRESENT);
+            __atomic_store_n(&metaData->frameOwner[physicalAddress >> 12], owner, __ATOMIC_RELEASE);
+            copy = NULL;
+        }
+        tlbInvalidatePage(metaData, pt, addr);
+        endRemoval(&space->seq);
+        __atomic_fetch_add(&metaData->cowFaults, 1, __ATOMIC_RELAXED);
+        status = VM_OK;
+    }
+
+    pthread_mutex_unlock(&metaData->frameLock);
+    pthread_mutex_unlock(&space->lock);
+    if(copy != NULL) freeFrame(metaData, copy, false);
+    return status;
+}
+
+// Will do the work of vm_translate.
+static vm_result_t translate(void *vm, paddr_t pt, vaddr_t addr, access_type_t access, bool user) {
+    // YOUR CODE HERE
+    metadata* metaData = (metadata*)vm;
+    uint32_t pageOffset = getOffset(addr);
+    uint32_t pageTableEntry;
+    uint32_t required = PTE_VALID | accessPermission[access] | (user ? PTE_USER : 0);
+    
+    vm_result_t translationResult;
+
+    // Only walk the page table if the TLB does not have the translation
+    if(!tlbLookup(metaData, pt, addr, &pageTableEntry)){
+        // Walk without locking. The walk is only trusted if neither a writer of the address space nor an
+        // eviction started or finished before the result is in the TLB, otherwise a writer could miss it.
+        spaceLock* space = getSpaceLock(metaData, pt);
+        uint32_t spaceSeq = __atomic_load_n(&space->seq, __ATOMIC_ACQUIRE);
+        uint32_t evictSeq = __atomic_load_n(&metaData->evictSeq, __ATOMIC_ACQUIRE);
+        pageTableEntry = walkPageTable(metaData, pt, addr);
+
+        bool trusted = !((spaceSeq | evictSeq) & 1) && (pageTableEntry & (PTE_VALID | PTE_PRESENT)) != PTE_VALID;
+        if(trusted && (pageTableEntry & (PTE_PRESENT | PTE_COW)) == PTE_PRESENT) tlbInsert(metaData, pt, addr, pageTableEntry);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(trusted && (__atomic_load_n(&space->seq, __ATOMIC_RELAXED) != spaceSeq || __atomic_load_n(&metaData->evictSeq, __ATOMIC_RELAXED) != evictSeq)){
+            tlbInvalidatePage(metaData, pt, addr);
+            trusted = false;
+        }
+
+        // Walk again with the locks held, which also faults a swapped out page in
+        if(!trusted){
+            vm_status_t status = translateLocked(metaData, space, pt, addr, required, &pageTableEntry);
+            if(status != VM_OK){
+                translationResult.status = status;
+                translationResult.addr = 0;
+                return translationResult;
+            }
+        }
+
+        // Check if there is a mapping at all
+        if(!(pageTableEntry & PTE_VALID)){
+            __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+            translationResult.status = VM_BAD_ADDR;
+            translationResult.addr = 0;
+            return translationResult;
+        }
+    }
+
+    // Check the type / source of access against the permission bits in one go
+    if((pageTableEntry & required) != required){
+        // A write to a copy-on-write page that is otherwise allowed makes the page private, then translates again
+        if(access == VM_WRITE && (pageTableEntry & (PTE_PRESENT | PTE_COW)) == (PTE_PRESENT | PTE_COW) && ((pageTableEntry | PTE_WRITE) & required) == required){
+            vm_status_t status = breakCopyOnWrite(metaData, pt, addr);
+            if(status == VM_OK) return translate(vm, pt, addr, access, user);
+            if(status != VM_BAD_PERM){
+                translationResult.status = status;
+                translationResult.addr = 0;
+                return translationResult;
+            }
+        }
+        __atomic_fetch_add(&metaData->badPerm, 1, __ATOMIC_RELAXED);
+        translationResult.status = VM_BAD_PERM;
+        translationResult.addr = 0;
+        return translationResult;
+    }
+    markReferenced(metaData, pageTableEntry >> 12, access == VM_WRITE);
+
+    // Return the mapping from the second table entry
+    translationResult.status = VM_OK;
+    translationResult.addr = (pageTableEntry & PTE_FRAME) + pageOffset;
+    return translationResult;
+
+}
+
+// Will do the work of vm_translate in the region rooted at pt, timing it when built with latency histograms.
+static vm_result_t translatePage(void* vm, paddr_t pt, vaddr_t addr, access_type_t access, bool user){
+#if defined(VM_LATENCY_HISTOGRAMS)
+    uint64_t start = __rdtsc();
+    vm_result_t result = translate(vm, pt, addr, access, user);
+    recordLatency(((metadata*)vm)->translateCycles, start);
+    return result;
+#else
+    return translate(vm, pt, addr, access, user);
+#endif
+}
+
+// description:
+// - translates a virtual address to a physical address if possible
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space being accessed
+// - addr: the virtual address to translate
+// - access: the access being made (instruction fetch, read, or write)
+// - user: the access is a user-level access (i.e., not a kernel access)
+// - safe to call from several threads at once, also while other threads map and unmap pages;
+//   translations that hit the TLB or find a resident page take no lock
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+// returns:
+// - the success status of the translation:
+//   - VM_OK if translation succeeded
+//   - VM_BAD_ADDR if there is no translation for this address
+//   - VM_BAD_PERM if permissions are not sufficient for the type / source of access requested
+//   - VM_OUT_OF_MEM if no physical page could be found for a swapped out or reserved page
+//   - VM_BAD_IO if accessing the swap file failed
+// - the resulting physical address (relevant only if status is VM_OK)
+vm_result_t vm_translate(void *vm, paddr_t pt, vaddr_t addr, access_type_t access, bool user) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    metadata* metaData = (metadata*)vm;
+    pt = findRegion(metaData, pt, addr);
+    if(pt == 0){
+        __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+        return (vm_result_t){ .status = VM_BAD_ADDR };
+    }
+#endif
+    return translatePage(vm, pt, regionOffset(addr), access, user);
+}
+
+// description:
+// - turns a chunk of gathered PTEs into translation results, checking the permissions of several entries at a time
+// arguments:
+// - entries: the L2 entries of the addresses (0 where there is no L2 table)
+// - addrs: the virtual addresses being translated
+// - count: the number of entries / addresses
+// - required: the PTE bits an entry must have for the access to be allowed
+// - out: receives one result per address
+static void resolveBatch(const uint32_t* entries, const vaddr_t* addrs, size_t count, uint32_t required, vm_result_t* out){
+    size_t i = 0;
+
+#if defined(__SSE2__) && VM_PAGE_TABLE_LEVELS == 2
+    // Each iteration checks four entries and writes four interleaved (status, addr) results
+    const __m128i need = _mm_set1_epi32(required);
+    const __m128i valid = _mm_set1_epi32(PTE_VALID);
+    const __m128i frame = _mm_set1_epi32(PTE_FRAME);
+    const __m128i offset = _mm_set1_epi32(0xFFF);
+    const __m128i badAddr = _mm_set1_epi32(VM_BAD_ADDR);
+    const __m128i badPerm = _mm_set1_epi32(VM_BAD_PERM);
+
+    for(; i + 4 <= count; i += 4){
+        __m128i pte = _mm_loadu_si128((const __m128i*)&entries[i]);
+        __m128i va = _mm_loadu_si128((const __m128i*)&addrs[i]);
+        __m128i granted = _mm_cmpeq_epi32(_mm_and_si128(pte, need), need);
+        __m128i mapped = _mm_cmpeq_epi32(_mm_and_si128(pte, valid), valid);
+
+        // status = granted ? VM_OK : (mapped ? VM_BAD_PERM : VM_BAD_ADDR), addr is 0 unless granted
+        __m128i status = _mm_andnot_si128(granted, _mm_or_si128(_mm_and_si128(mapped, badPerm), _mm_andnot_si128(mapped, badAddr)));
+        __m128i pa = _mm_and_si128(granted, _mm_or_si128(_mm_and_si128(pte, frame), _mm_and_si128(va, offset)));
+
+        _mm_storeu_si128((__m128i*)&out[i], _mm_unpacklo_epi32(status, pa));
+        _mm_storeu_si128((__m128i*)&out[i + 2], _mm_unpackhi_epi32(status, pa));
+    }
+#endif
+
+    for(; i < count; i++){
+        if((entries[i] & required) == required){
+            out[i].status = VM_OK;
+            out[i].addr = (entries[i] & PTE_FRAME) | getOffset(addrs[i]);
+        }else{
+            out[i].status = (entries[i] & PTE_VALID) ? VM_BAD_PERM : VM_BAD_ADDR;
+            out[i].addr = 0;
+        }
+    }
+}
+
+// Will do the work of vm_translate_batch for addresses that all lie in the region rooted at pt.
+static void translateBatch(void* vm, paddr_t pt, const vaddr_t* addrs, size_t n, access_type_t access, bool user, vm_result_t* out){
+    metadata* metaData = (metadata*)vm;
+    uint32_t required = PTE_VALID | PTE_PRESENT | accessPermission[access] | (user ? PTE_USER : 0);
+    uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    uint32_t physicalSize = (uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart;
+    spaceLock* space = getSpaceLock(metaData, pt);
+    uint32_t entries[VM_BATCH_CHUNK];
+
+    size_t base = 0;
+    while(base < n){
+        size_t count = (n - base < VM_BATCH_CHUNK) ? n - base : VM_BATCH_CHUNK;
+        uint32_t* secondLevelTable = NULL;
+        uint32_t firstLevelEntry = 0;
+        uint32_t currentFirstLevel = 0xFFFFFFFF;
+        uint32_t spaceSeq = __atomic_load_n(&space->seq, __ATOMIC_ACQUIRE);
+
+        // Gather the L2 entries, only reading the L1 entry when the group changes
+        for(size_t i = 0; i < count; i++){
+            vaddr_t addr = addrs[base + i];
+            uint32_t firstLevel = getFirstLevel(addr);
+
+            if(firstLevel != currentFirstLevel){
+                firstLevelEntry = loadEntry(&topLevelTable[firstLevel]);
+                currentFirstLevel = firstLevel;
+                secondLevelTable = ((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == PTE_VALID && (firstLevelEntry & PTE_FRAME) < physicalSize) ? (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME)) : NULL;
+            }
+            if(secondLevelTable) entries[i] = loadEntry(&secondLevelTable[getSecondLevel(addr)]);
+            else entries[i] = ((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == (PTE_VALID | PTE_LARGE)) ? superpageEntry(firstLevelEntry, getSecondLevel(addr)) : 0;
+        }
+
+        // A writer of the address space may have freed a table under the gather, fall back to vm_translate
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if((spaceSeq & 1) || __atomic_load_n(&space->seq, __ATOMIC_RELAXED) != spaceSeq){
+            for(size_t i = 0; i < count; i++){
+                out[base + i] = translatePage(vm, pt, regionOffset(addrs[base + i]), access, user);
+            }
+            base += count;
+            continue;
+        }
+
+        resolveBatch(entries, &addrs[base], count, required, &out[base]);
+
+        // A swapped out entry, or a write to a copy-on-write page, is handed to vm_translate to fault it in.
+        // That may evict pages gathered after it, so the rest of the chunk is gathered again.
+        size_t done = count;
+        uint64_t badAddr = 0, badPerm = 0;
+        for(size_t i = 0; i < count; i++){
+            if(out[base + i].status == VM_OK){
+                markReferenced(metaData, out[base + i].addr >> 12, access == VM_WRITE);
+            }else if((entries[i] & (PTE_VALID | PTE_PRESENT)) == PTE_VALID || (access == VM_WRITE && (entries[i] & (PTE_PRESENT | PTE_COW)) == (PTE_PRESENT | PTE_COW))){
+                out[base + i] = translatePage(vm, pt, regionOffset(addrs[base + i]), access, user);
+                done = i + 1;
+                break;
+            }else if(out[base + i].status == VM_BAD_ADDR){
+                badAddr++;
+            }else{
+                badPerm++;
+            }
+        }
+        if(badAddr) __atomic_fetch_add(&metaData->badAddr, badAddr, __ATOMIC_RELAXED);
+        if(badPerm) __atomic_fetch_add(&metaData->badPerm, badPerm, __ATOMIC_RELAXED);
+        base += done;
+    }
+}
+
+// description:
+// - translates many virtual addresses of one address space at once
+// - consecutive addresses that share an L1 entry reuse the same L2 table, so each table is walked once per group
+// - the TLB is neither consulted nor filled, except for swapped out and copy-on-write pages which go through vm_translate
+// - takes no lock; a chunk that raced with a writer of the address space is translated again through vm_translate
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space being accessed
+// - addrs: the virtual addresses to translate
+// - n: the number of addresses
+// - access: the access being made (instruction fetch, read, or write), same for all addresses
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// - out: receives n results, out[i] being what vm_translate would return for addrs[i]
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+void vm_translate_batch(void *vm, paddr_t pt, const vaddr_t *addrs, size_t n, access_type_t access, bool user, vm_result_t *out) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    // Consecutive addresses in the same region are translated together
+    metadata* metaData = (metadata*)vm;
+    size_t base = 0;
+    while(base < n){
+        size_t count = 1;
+        while(base + count < n && addrs[base + count] >> 32 == addrs[base] >> 32) count++;
+        paddr_t root = findRegion(metaData, pt, addrs[base]);
+        if(root != 0){
+            translateBatch(vm, root, &addrs[base], count, access, user, &out[base]);
+        }else{
+            for(size_t i = 0; i < count; i++) out[base + i] = (vm_result_t){ .status = VM_BAD_ADDR };
+            __atomic_fetch_add(&metaData->badAddr, count, __ATOMIC_RELAXED);
+        }
+        base += count;
+    }
+#else
+    translateBatch(vm, pt, addrs, n, access, user, out);
+#endif
+}
+
+// Will add a page (or the part of it in range) to the runs, extending the last run if the page follows it.
+// Returns false if that needs a new run and all maxRuns are in use.
+static bool appendRun(vm_iovec_t* runs, size_t maxRuns, size_t* runCount, paddr_t addr, uint32_t len){
+    if(*runCount > 0 && runs[*runCount - 1].addr + runs[*runCount - 1].len == addr){
+        runs[*runCount - 1].len += len;
+        return true;
+    }
+    if(*runCount == maxRuns) return false;
+    runs[*runCount].addr = addr;
+    runs[*runCount].len = len;
+    (*runCount)++;
+    return true;
+}
+
+// description:
+// - does the work of vm_translate_range, walking each L2 table once without taking a lock
+// - the pages under one L1 entry are checked as a group: if a writer of the address space or an eviction ran
+//   while they were read, the group's runs are dropped and its first page goes through translate
+// - a page that is not resident with the permissions the access needs (swapped out, copy-on-write, not mapped)
+//   also goes through translate, which faults it in or tells what is wrong
+// arguments:
+// - metaData: the VM system metadata
+// - pt, addr, len, access, user, runs, maxRuns: see vm_translate_range
+// - runCount: the number of runs already in runs, the first page may extend the last of them; receives the new total
+// - covered: receives the number of bytes of the range the runs cover
+// - stopBeforeFault: return before a page that needs translate, unless it is the first one, so that bringing
+//   it in cannot evict a page of the runs returned
+// returns:
+// - VM_OK, or the status translate gave for the page at addr + *covered
+static vm_status_t translateRange(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len, access_type_t access, bool user,
+                                  vm_iovec_t* runs, size_t maxRuns, size_t* runCount, size_t* covered, bool stopBeforeFault){
+    uint32_t required = PTE_VALID | PTE_PRESENT | accessPermission[access] | (user ? PTE_USER : 0);
+    uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    uint32_t physicalSize = (uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart;
+    spaceLock* space = getSpaceLock(metaData, pt);
+
+    *covered = 0;
+    if((uint64_t)len > 0x100000000ull - addr){
+        __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+        return VM_BAD_ADDR;
+    }
+
+    while(*covered < len){
+        size_t groupRuns = *runCount;
+        uint32_t groupLastLen = groupRuns ? runs[groupRuns - 1].len : 0;
+        size_t groupCovered = *covered;
+        uint32_t spaceSeq = __atomic_load_n(&space->seq, __ATOMIC_ACQUIRE);
+        uint32_t evictSeq = __atomic_load_n(&metaData->evictSeq, __ATOMIC_ACQUIRE);
+
+        uint32_t firstLevelEntry = loadEntry(&topLevelTable[getFirstLevel(addr + *covered)]);
+        uint32_t* secondLevelTable = ((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == PTE_VALID && (firstLevelEntry & PTE_FRAME) < physicalSize) ? (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME)) : NULL;
+        bool full = false, slow = false;
+        do{
+            vaddr_t current = addr + *covered;
+            uint32_t pageTableEntry;
+            if(secondLevelTable) pageTableEntry = loadEntry(&secondLevelTable[getSecondLevel(current)]);
+            else pageTableEntry = ((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == (PTE_VALID | PTE_LARGE)) ? superpageEntry(firstLevelEntry, getSecondLevel(current)) : 0;
+            if((pageTableEntry & required) != required){
+                slow = true;
+                break;
+            }
+
+            uint32_t chunk = 4096 - getOffset(current);
+            if(chunk > len - *covered) chunk = len - *covered;
+            if(!appendRun(runs, maxRuns, runCount, (pageTableEntry & PTE_FRAME) | getOffset(current), chunk)){
+                full = true;
+                break;
+            }
+            markReferenced(metaData, pageTableEntry >> 12, access == VM_WRITE);
+            *covered += chunk;
+        }while(*covered < len && getSecondLevel(addr + *covered) != 0);
+
+        // A table may have been freed, or a page evicted, under the walk: drop the group's runs
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(((spaceSeq | evictSeq) & 1) || __atomic_load_n(&space->seq, __ATOMIC_RELAXED) != spaceSeq || __atomic_load_n(&metaData->evictSeq, __ATOMIC_RELAXED) != evictSeq){
+            *runCount = groupRuns;
+            if(groupRuns) runs[groupRuns - 1].len = groupLastLen;
+            *covered = groupCovered;
+            full = false;
+            slow = true;
+        }
+        if(full) return VM_OK;
+        if(!slow) continue;
+
+        if(stopBeforeFault && *covered > 0) return VM_OK;
+        vaddr_t current = addr + *covered;
+        vm_result_t result = translate(metaData, pt, current, access, user);
+        if(result.status != VM_OK) return result.status;
+        uint32_t chunk = 4096 - getOffset(current);
+        if(chunk > len - *covered) chunk = len - *covered;
+        if(!appendRun(runs, maxRuns, runCount, result.addr, chunk)) return VM_OK;
+        *covered += chunk;
+    }
+    return VM_OK;
+}
+
+// description:
+// - translates a range of virtual addresses into the physically contiguous runs that back it, in order
+// - consecutive pages in consecutive frames share a run; each L2 table is walked once, without a lock
+// - the TLB is neither consulted nor filled; swapped out and copy-on-write pages go through vm_translate,
+//   and when memory is short, bringing one in may evict a page of a run found earlier in the same call
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space being accessed
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - access: the access being made (instruction fetch, read, or write), same for the whole range
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// - iov_out: receives the runs
+// - max_iov: the number of runs iov_out has room for
+// - n_iov: receives the number of runs written to iov_out
+// returns:
+// - VM_OK if the runs cover the range, or as much of it as max_iov runs can: the caller continues after them
+// - otherwise what vm_translate returned for the first page that failed (VM_BAD_ADDR also if the range runs
+//   past the end of the virtual address space); the runs cover the part of the range before that page
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_translate_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, access_type_t access, bool user, vm_iovec_t *iov_out, size_t max_iov, size_t *n_iov) {
+    metadata* metaData = (metadata*)vm;
+    size_t covered;
+    *n_iov = 0;
+#if VM_PAGE_TABLE_LEVELS == 4
+    // Each region is translated on its own, a run may go on across the boundary between two of them
+    paddr_t root = rangeInSpace(addr, len) ? findRegion(metaData, pt, addr) : 0;
+    for(size_t done = 0; done < len; done += covered){
+        if(root == 0){
+            __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+            return VM_BAD_ADDR;
+        }
+        size_t chunk = regionChunk(addr + done, len - done);
+        vm_status_t status = translateRange(metaData, root, regionOffset(addr + done), chunk, access, user, iov_out, max_iov, n_iov, &covered, false);
+        if(status != VM_OK || covered < chunk) return status;
+        root = findRegion(metaData, pt, addr + done + chunk);
+    }
+    return VM_OK;
+#else
+    return translateRange(metaData, pt, addr, len, access, user, iov_out, max_iov, n_iov, &covered, false);
+#endif
+}
+
+// Will tell whether the page at addr of the region with top-level table root still maps the frame of
+// physicalAddress with the required permissions. Called with frameLock held, which keeps evictions out.
+static bool stillMapped(metadata* metaData, paddr_t root, vaddr_t addr, uint32_t required, paddr_t physicalAddress){
+    uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + root);
+    uint32_t physicalSize = (uintptr_t)metaData->vmEnd - (uintptr_t)metaData->vmStart;
+    uint32_t firstLevelEntry = loadEntry(&topLevelTable[getFirstLevel(addr)]);
+    uint32_t pageTableEntry;
+    if((firstLevelEntry & (PTE_VALID | PTE_LARGE)) == (PTE_VALID | PTE_LARGE)){
+        pageTableEntry = superpageEntry(firstLevelEntry, getSecondLevel(addr));
+    }else{
+        if(!(firstLevelEntry & PTE_VALID) || (firstLevelEntry & PTE_FRAME) >= physicalSize) return false;
+        pageTableEntry = loadEntry((uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME)) + getSecondLevel(addr));
+    }
+    return (pageTableEntry & required) == required && (pageTableEntry & PTE_FRAME) == (physicalAddress & PTE_FRAME);
+}
+
+// Will copy between a host buffer and a range of virtual addresses, see vm_read and vm_write.
+// Each translateRange call stops before a page it would have to bring in, so its runs are copied before that.
+// An eviction may take a page between its translation and its copy, and hand the frame to someone else: each
+// page is checked again and copied with frameLock held, and one that moved is translated again.
+static vm_status_t copyRange(metadata* metaData, paddr_t pt, vaddr_t addr, void* buffer, size_t len, bool user, bool write){
+    vm_iovec_t runs[VM_COPY_RUNS];
+    access_type_t access = write ? VM_WRITE : VM_READ;
+    uint32_t required = PTE_VALID | PTE_PRESENT | accessPermission[access] | (user ? PTE_USER : 0);
+    size_t done = 0;
+#if VM_PAGE_TABLE_LEVELS == 4
+    if(!rangeInSpace(addr, len)){
+        __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+        return VM_BAD_ADDR;
+    }
+#endif
+    while(done < len){
+        size_t runCount = 0, covered;
+        paddr_t root = pt;
+        size_t chunk = len - done;
+#if VM_PAGE_TABLE_LEVELS == 4
+        root = findRegion(metaData, pt, addr + done);
+        if(root == 0){
+            __atomic_fetch_add(&metaData->badAddr, 1, __ATOMIC_RELAXED);
+            return VM_BAD_ADDR;
+        }
+        chunk = regionChunk(addr + done, chunk);
+#endif
+        vm_status_t status = translateRange(metaData, root, regionOffset(addr + done), chunk, access, user, runs, VM_COPY_RUNS, &runCount, &covered, true);
+
+        size_t copied = 0;
+        bool moved = false;
+        pthread_mutex_lock(&metaData->frameLock);
+        for(size_t i = 0; i < runCount && !moved; i++){
+            paddr_t physicalAddress = runs[i].addr;
+            for(size_t left = runs[i].len; left > 0; ){
+                size_t bytes = 4096 - getOffset(physicalAddress);
+                if(bytes > left) bytes = left;
+                moved = !stillMapped(metaData, root, regionOffset(addr + done + copied), required, physicalAddress);
+                if(moved) break;
+
+                // The written bit is set again: a page brought back in since its translation has lost it,
+                // and would be evicted as clean
+                void* guest = (void*)((uintptr_t)metaData->vmStart + physicalAddress);
+                char* host = (char*)buffer + done + copied;
+                markReferenced(metaData, physicalAddress >> 12, write);
+                if(write) memcpy(guest, host, bytes);
+                else memcpy(host, guest, bytes);
+                copied += bytes;
+                physicalAddress += bytes;
+                left -= bytes;
+            }
+        }
+        pthread_mutex_unlock(&metaData->frameLock);
+        done += copied;
+        if(copied < covered) continue;
+        if(status != VM_OK) return status;
+    }
+    return VM_OK;
+}
+
+// description:
+// - copies a range of virtual memory of an address space into a host buffer, with VM_READ accesses
+// - other threads may evict pages meanwhile: a page evicted between its translation and its copy is translated again
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address to read
+// - buf: receives len bytes
+// - len: the number of bytes
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// returns:
+// - VM_OK if the whole range was copied
+// - otherwise what vm_translate returned for the first page that could not be read; the bytes before it are copied
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_read(void *vm, paddr_t pt, vaddr_t addr, void *buf, size_t len, bool user) {
+    return copyRange((metadata*)vm, pt, addr, buf, len, user, false);
+}
+
+// description:
+// - copies a host buffer into a range of virtual memory of an address space, with VM_WRITE accesses
+// - other threads may evict pages meanwhile: a page evicted between its translation and its copy is translated again
+// - copy-on-write pages of the range get their private copy first, like with vm_translate
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address to write
+// - buf: the len bytes to write
+// - len: the number of bytes
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// returns:
+// - VM_OK if the whole range was written
+// - otherwise what vm_translate returned for the first page that could not be written; the bytes before it are written
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_write(void *vm, paddr_t pt, vaddr_t addr, const void *buf, size_t len, bool user) {
+    return copyRange((metadata*)vm, pt, addr, (void*)buf, len, user, true);
+}
+
+// description:
+// - reports how effective the software TLB in front of vm_translate has been
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - hits: receives the number of translations served from the TLB (may be NULL)
+// - misses: receives the number of translations that walked the page table (may be NULL)
+void vm_tlb_stats(void *vm, uint64_t *hits, uint64_t *misses) {
+    metadata* metaData = (metadata*)vm;
+    if(hits) *hits = __atomic_load_n(&metaData->tlbHits, __ATOMIC_RELAXED);
+    if(misses) *misses = __atomic_load_n(&metaData->tlbMisses, __ATOMIC_RELAXED);
+}
+
+// Will lock the next region at or after *region of the address space of asid, whose top-level table is pt, like
+// nextRegion. vm_destroy_addr_space clears the ASID under the lock at pt before it frees anything, so it is
+// checked again under that lock before the directories are walked, and under the region lock before the region
+// is read. The two locks are never held together, they may be the same mutex. Returns 0, with nothing locked,
+// once no region is left or the address space is gone.
+static paddr_t lockLiveRegion(metadata* metaData, asid_t asid, paddr_t pt, uint32_t* region){
+    spaceLock* space = getSpaceLock(metaData, pt);
+    pthread_mutex_lock(&space->lock);
+    paddr_t root = 0;
+    if(__atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE) == pt) root = nextRegion(metaData, pt, region);
+    pthread_mutex_unlock(&space->lock);
+    if(root == 0) return 0;
+
+    space = getSpaceLock(metaData, root);
+    pthread_mutex_lock(&space->lock);
+    if(__atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE) != pt){
+        pthread_mutex_unlock(&space->lock);
+        return 0;
+    }
+    return root;
+}
+
+// description:
+// - takes a snapshot of the state of the VM system and of its event counters
+// - the counters are kept with relaxed atomics on the hot paths; the page counts are computed here,
+//   from the free frame bitmaps, the magazines and the top-level tables of the active address spaces
+// - the snapshot is not atomic, calls running meanwhile may leave it slightly inconsistent
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - stats: receives the snapshot
+void vm_get_stats(void *vm, vm_stats_t *stats) {
+    metadata* metaData = (metadata*)vm;
+    memset(stats, 0, sizeof(*stats));
+    stats->total_pages = metaData->numPages;
+    stats->reserved_pages = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    stats->swap_slots = metaData->numSwapPages;
+
+    pthread_mutex_lock(&metaData->frameLock);
+    stats->zeroed_pages = hbitmapCount(&metaData->zeroedFrames);
+    stats->free_pages = stats->zeroed_pages + hbitmapCount(&metaData->dirtyFrames);
+    stats->swap_copies = metaData->swapCopies;
+    stats->cold_pages = __atomic_load_n(&metaData->coldPages, __ATOMIC_RELAXED);
+    stats->swapped_pages = metaData->numSwapPages - hbitmapCount(&metaData->swapSlotFree) - metaData->swapCopies;
+    stats->compressed_pages = metaData->zswapPages;
+    stats->compressed_bytes = metaData->zswapBytes;
+    uint32_t firstFrame = stats->reserved_pages;
+    for(uint32_t frame = firstFrame; frame < firstFrame + metaData->numPages; frame++){
+        if(metaData->frameRefs[frame] & FRAME_REFS) stats->shared_pages++;
+    }
+    pthread_mutex_unlock(&metaData->frameLock);
+
+    for(uint32_t i = 0; i < metaData->numMagazines; i++){
+        pthread_mutex_lock(&metaData->magazines[i].lock);
+        stats->cached_pages += metaData->magazines[i].count;
+        pthread_mutex_unlock(&metaData->magazines[i].lock);
+    }
+
+    // Each active address space has its directories, and each of its regions a top-level table and one L2 table
+    // per valid L1 entry that is not a superpage. Address spaces destroyed meanwhile are skipped
+    stats->asid_limit = metaData->numAsids;
+    for(uint32_t asid = 0; asid < metaData->numAsids; asid++){
+        paddr_t pt = __atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE);
+        if(pt == 0) continue;
+        spaceLock* space = getSpaceLock(metaData, pt);
+        pthread_mutex_lock(&space->lock);
+        bool live = __atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE) == pt;
+        if(live){
+            stats->address_spaces++;
+            stats->table_pages += directoryPages(metaData, pt);
+        }
+        pthread_mutex_unlock(&space->lock);
+        if(!live) continue;
+
+        paddr_t root;
+        for(uint32_t region = 0; (root = lockLiveRegion(metaData, asid, pt, &region)) != 0; region++){
+            space = getSpaceLock(metaData, root);
+            uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + root);
+            uint32_t occupancy = metaData->frameCount[root >> 12];
+            stats->table_pages++;
+            while(occupancy){
+                uint32_t group = __builtin_ctz(occupancy);
+                occupancy &= occupancy - 1;
+                for(uint32_t i = group * 32; i < group * 32 + 32; i++){
+                    if((topLevelTable[i] & (PTE_VALID | PTE_LARGE)) == PTE_VALID) stats->table_pages++;
+                }
+            }
+            pthread_mutex_unlock(&space->lock);
+        }
+    }
+
+    // Whatever is neither free, cached nor a table holds data (or is on its way between those)
+    uint64_t notData = stats->free_pages + stats->cached_pages + stats->table_pages;
+    stats->data_pages = (notData < stats->total_pages) ? stats->total_pages - notData : 0;
+
+    stats->tlb_hits = __atomic_load_n(&metaData->tlbHits, __ATOMIC_RELAXED);
+    stats->tlb_misses = __atomic_load_n(&metaData->tlbMisses, __ATOMIC_RELAXED);
+    stats->bad_addr = __atomic_load_n(&metaData->badAddr, __ATOMIC_RELAXED);
+    stats->bad_perm = __atomic_load_n(&metaData->badPerm, __ATOMIC_RELAXED);
+    stats->swap_ins = __atomic_load_n(&metaData->swapIns, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&metaData->evictions, __ATOMIC_RELAXED);
+    stats->clean_evictions = __atomic_load_n(&metaData->cleanEvictions, __ATOMIC_RELAXED);
+    stats->swap_file_reads = __atomic_load_n(&metaData->swapFileReads, __ATOMIC_RELAXED);
+    stats->swap_file_writes = __atomic_load_n(&metaData->swapFileWrites, __ATOMIC_RELAXED);
+    stats->swap_io_calls = __atomic_load_n(&metaData->swapIoCalls, __ATOMIC_RELAXED);
+    stats->swap_readahead = __atomic_load_n(&metaData->swapReadahead, __ATOMIC_RELAXED);
+    stats->cow_faults = __atomic_load_n(&metaData->cowFaults, __ATOMIC_RELAXED);
+    stats->zero_fills = __atomic_load_n(&metaData->zeroFills, __ATOMIC_RELAXED);
+    stats->pages_mapped = __atomic_load_n(&metaData->pagesMapped, __ATOMIC_RELAXED);
+    stats->pages_unmapped = __atomic_load_n(&metaData->pagesUnmapped, __ATOMIC_RELAXED);
+    stats->pages_merged = __atomic_load_n(&metaData->pagesMerged, __ATOMIC_RELAXED);
+    stats->prefetches = __atomic_load_n(&metaData->prefetches, __ATOMIC_RELAXED);
+#if defined(VM_LATENCY_HISTOGRAMS)
+    for(uint32_t bucket = 0; bucket < VM_STATS_LATENCY_BUCKETS; bucket++){
+        stats->translate_cycles[bucket] = __atomic_load_n(&metaData->translateCycles[bucket], __ATOMIC_RELAXED);
+        stats->map_cycles[bucket] = __atomic_load_n(&metaData->mapCycles[bucket], __ATOMIC_RELAXED);
+        stats->unmap_cycles[bucket] = __atomic_load_n(&metaData->unmapCycles[bucket], __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+// Will add the tables and pages of the region rooted at pt to stats, with its lock and frameLock held.
+static void countRegion(metadata* metaData, paddr_t pt, vm_asid_stats_t* stats){
+    uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    uint32_t occupancy = metaData->frameCount[pt >> 12];
+    stats->table_pages++;
+    while(occupancy){
+        uint32_t group = __builtin_ctz(occupancy);
+        occupancy &= occupancy - 1;
+
+        for(uint32_t i = group * 32; i < group * 32 + 32; i++){
+            uint32_t firstLevelEntry = topLevelTable[i];
+            if(!(firstLevelEntry & PTE_VALID)) continue;
+            if(firstLevelEntry & PTE_LARGE){
+                stats->resident_pages += 1024;
+                continue;
+            }
+            stats->table_pages++;
+
+            uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME));
+            uint32_t remaining = metaData->frameCount[firstLevelEntry >> 12];
+            for(uint32_t j = 0; remaining > 0; j++){
+                if(!(secondLevelTable[j] & PTE_VALID)) continue;
+                remaining--;
+                if(!(secondLevelTable[j] & PTE_PRESENT)){
+                    if(reservedEntry(secondLevelTable[j])) stats->untouched_pages++;
+                    else stats->swapped_pages++;
+                    continue;
+                }
+                stats->resident_pages++;
+                if(metaData->frameRefs[secondLevelTable[j] >> 12] & FRAME_REFS) stats->shared_pages++;
+            }
+        }
+    }
+}
+
+// description:
+// - reports how much memory one address space uses, by walking its page tables with its lock held
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: the ID of the address space
+// - stats: receives the sizes
+// returns:
+// - VM_OK, or VM_BAD_ADDR if the address space is not active
+vm_status_t vm_get_asid_stats(void *vm, asid_t asid, vm_asid_stats_t *stats) {
+    metadata* metaData = (metadata*)vm;
+    memset(stats, 0, sizeof(*stats));
+    if(asid >= metaData->numAsids) return VM_BAD_ADDR;
+    paddr_t pt = __atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE);
+    if(pt == 0) return VM_BAD_ADDR;
+
+    // frameLock keeps evictions from moving pages to swap while the tables are counted
+    stats->table_pages = directoryPages(metaData, pt);
+    paddr_t root;
+    for(uint32_t region = 0; (root = nextRegion(metaData, pt, &region)) != 0; region++){
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        pthread_mutex_lock(&metaData->frameLock);
+        countRegion(metaData, root, stats);
+        pthread_mutex_unlock(&metaData->frameLock);
+        pthread_mutex_unlock(&space->lock);
+    }
+    return VM_OK;
+}
+
+// Will count a resident page towards a working set and clear its accessed and written bits.
+// A written page gives up its swap copy before its written bit goes. Called with frameLock held.
+static void scanFrame(metadata* metaData, uint32_t frame, vm_working_set_t* ws){
+    uint64_t bit = (uint64_t)1 << (frame % 64);
+    ws->resident_pages++;
+    if(__atomic_load_n(&metaData->accessed[frame / 64], __ATOMIC_RELAXED) & bit){
+        __atomic_fetch_and(&metaData->accessed[frame / 64], ~bit, __ATOMIC_RELAXED);
+        ws->accessed_pages++;
+    }
+    if(__atomic_load_n(&metaData->written[frame / 64], __ATOMIC_RELAXED) & bit){
+        dropSwapCopy(metaData, frame);
+        __atomic_fetch_and(&metaData->written[frame / 64], ~bit, __ATOMIC_RELAXED);
+        ws->dirty_pages++;
+    }
+}
+
+// Will scan the resident pages of the region rooted at pt into ws, with its lock and frameLock held.
+static void scanRegion(metadata* metaData, paddr_t pt, vm_working_set_t* ws){
+    uint32_t* topLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + pt);
+    uint32_t occupancy = metaData->frameCount[pt >> 12];
+    while(occupancy){
+        uint32_t group = __builtin_ctz(occupancy);
+        occupancy &= occupancy - 1;
+
+        for(uint32_t i = group * 32; i < group * 32 + 32; i++){
+            uint32_t firstLevelEntry = topLevelTable[i];
+            if(!(firstLevelEntry & PTE_VALID)) continue;
+            if(firstLevelEntry & PTE_LARGE){
+                for(uint32_t j = 0; j < 1024; j++) scanFrame(metaData, (firstLevelEntry >> 12) + j, ws);
+                continue;
+            }
+
+            uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (firstLevelEntry & PTE_FRAME));
+            uint32_t remaining = metaData->frameCount[firstLevelEntry >> 12];
+            for(uint32_t j = 0; remaining > 0; j++){
+                if(!(secondLevelTable[j] & PTE_VALID)) continue;
+                remaining--;
+                if(secondLevelTable[j] & PTE_PRESENT) scanFrame(metaData, secondLevelTable[j] >> 12, ws);
+            }
+        }
+    }
+}
+
+// description:
+// - estimates the working set of an address space: how many of its resident pages were used since the previous scan
+// - harvests the accessed and written bits that translations set per physical page, and clears them for the next scan
+// - the bits live in bitmaps beside the page tables, so translations never write to a PTE; a page shared with
+//   other address spaces has one set of bits for all of them
+// - a page found written gives up the copy it kept in swap since its swap in, which is out of date
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: the ID of the address space
+// - ws: receives the counts
+// returns:
+// - VM_OK, or VM_BAD_ADDR if the address space is not active
+vm_status_t vm_scan_working_set(void *vm, asid_t asid, vm_working_set_t *ws) {
+    metadata* metaData = (metadata*)vm;
+    memset(ws, 0, sizeof(*ws));
+    if(asid >= metaData->numAsids) return VM_BAD_ADDR;
+    paddr_t pt = __atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE);
+    if(pt == 0) return VM_BAD_ADDR;
+
+    // frameLock keeps evictions from taking pages, and their swap copies, while the bits are harvested
+    paddr_t root;
+    for(uint32_t region = 0; (root = nextRegion(metaData, pt, &region)) != 0; region++){
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        pthread_mutex_lock(&metaData->frameLock);
+        scanRegion(metaData, root, ws);
+        pthread_mutex_unlock(&metaData->frameLock);
+        pthread_mutex_unlock(&space->lock);
+    }
+    return VM_OK;
+}
+
+// description:
+// - zeroes free pages ahead of time so that allocations find them ready
+// - freed pages are not cleared on the map / unmap path, they wait on the dirty frames until this is called
+// - uses non-temporal stores, so the zeroed pages do not displace the working set from the cache
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - budget: the maximum number of pages to zero
+// returns:
+// - the number of pages zeroed (less than budget once no dirty page is left)
+size_t vm_idle_zero(void *vm, size_t budget) {
+    metadata* metaData = (metadata*)vm;
+    size_t zeroed = 0;
+    uint32_t frame;
+
+    // The page is in neither bitmap while it is cleared, so the lock is not held for the clearing
+    for(; zeroed < budget; zeroed++){
+        pthread_mutex_lock(&metaData->frameLock);
+        bool found = hbitmapNext(&metaData->dirtyFrames, 0, &frame);
+        if(found) hbitmapClear(&metaData->dirtyFrames, frame);
+        pthread_mutex_unlock(&metaData->frameLock);
+        if(!found) break;
+
+        zeroPageNonTemporal((void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12)));
+        zeroFence();
+
+        pthread_mutex_lock(&metaData->frameLock);
+        hbitmapSet(&metaData->zeroedFrames, frame);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    return zeroed;
+}
+
+// Will hash the contents of a page. The hash only picks merge candidates, equal pages are still compared in full.
+static uint32_t hashPage(const void* page){
+#if defined(__SSE2__)
+    // Four independent multiply-and-fold chains, so that the multiplications of a line overlap
+    const __m128i* line = (const __m128i*)page;
+    const __m128i prime = _mm_set1_epi32(0x9E3779B1);
+    __m128i hash[4] = { _mm_set1_epi32(1), _mm_set1_epi32(2), _mm_set1_epi32(3), _mm_set1_epi32(4) };
+    for(uint32_t i = 0; i < 256; i += 4){
+        for(uint32_t lane = 0; lane < 4; lane++){
+            __m128i mixed = _mm_xor_si128(hash[lane], _mm_load_si128(&line[i + lane]));
+            hash[lane] = _mm_add_epi64(_mm_mul_epu32(mixed, prime), _mm_srli_epi64(mixed, 32));
+        }
+    }
+    __m128i folded = _mm_xor_si128(_mm_xor_si128(hash[0], _mm_slli_epi64(hash[1], 7)), _mm_xor_si128(_mm_slli_epi64(hash[2], 13), _mm_slli_epi64(hash[3], 19)));
+    uint64_t halves[2];
+    _mm_storeu_si128((__m128i*)halves, folded);
+    uint64_t result = halves[0] ^ (halves[1] * 0x9E3779B97F4A7C15ull);
+#else
+    const uint64_t* word = (const uint64_t*)page;
+    uint64_t result = 1;
+    for(uint32_t i = 0; i < 512; i++){
+        result = (result ^ word[i]) * 0x9E3779B97F4A7C15ull;
+    }
+#endif
+    return (uint32_t)(result ^ (result >> 32));
+}
+
+// description:
+// - points the PTE of a private page at another page with the same contents and frees the page
+// - both pages' PTEs end up copy-on-write; the target may be private or already shared copy-on-write
+// - called with frameLock held; PTEs of any address space are rewritten the way evictPage does it
+// arguments:
+// - metaData: the VM system metadata
+// - frame: the private page to merge away
+// - target: the page to keep, any frame number (it is checked here)
+// returns:
+// - true if the pages were merged and frame is free
+static bool mergePage(metadata* metaData, uint32_t frame, uint32_t target){
+    uint32_t firstFrame = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    if(target == frame || target < firstFrame || target >= firstFrame + metaData->numPages) return false;
+
+    // Claim the page from the eviction clock and from vm_unmap_page, as evictPage does
+    uint32_t owner = __atomic_load_n(&metaData->frameOwner[frame], __ATOMIC_ACQUIRE);
+    if(owner == 0 || !__atomic_compare_exchange_n(&metaData->frameOwner[frame], &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return false;
+
+    // A private target is claimed the same way. A shared one must not be writable through any mapping.
+    uint32_t targetOwner = __atomic_load_n(&metaData->frameOwner[target], __ATOMIC_ACQUIRE);
+    bool claimed = targetOwner != 0 && __atomic_compare_exchange_n(&metaData->frameOwner[target], &targetOwner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    bool copyOnWrite = targetOwner == 0 && (metaData->frameRefs[target] & FRAME_REFS) && !(metaData->frameRefs[target] & FRAME_SHARED);
+
+    void* page = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12));
+    void* targetPage = (void*)((uintptr_t)metaData->vmStart + ((uintptr_t)target << 12));
+    if(!(claimed || copyOnWrite) || memcmp(page, targetPage, 4096) != 0){
+        if(claimed) __atomic_store_n(&metaData->frameOwner[target], targetOwner, __ATOMIC_RELEASE);
+        __atomic_store_n(&metaData->frameOwner[frame], owner, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    // Lock-free readers of any address space learn about the rewrite from evictSeq
+    uint32_t* pageTableEntry = (uint32_t*)((uintptr_t)metaData->vmStart + owner);
+    beginRemoval(&metaData->evictSeq);
+    if(claimed){
+        uint32_t* targetEntry = (uint32_t*)((uintptr_t)metaData->vmStart + targetOwner);
+        storeEntry(targetEntry, copyOnWriteEntry(*targetEntry));
+        tlbInvalidateFrame(metaData, target);
+    }
+    storeEntry(pageTableEntry, (target << 12) | (copyOnWriteEntry(*pageTableEntry) & ~PTE_FRAME));
+    tlbInvalidateFrame(metaData, frame);
+    endRemoval(&metaData->evictSeq);
+
+    metaData->frameRefs[target]++;
+    clearAccessBits(metaData, frame);
+    dropSwapCopy(metaData, frame);
+    addDirtyPage(metaData, page);
+    return true;
+}
+
+// description:
+// - merges resident data pages with identical contents into one copy-on-write page (like KSM)
+// - looks at the next budget frames after the ones the previous call looked at, wrapping around physical memory
+// - each private data page is hashed; a page whose hash bucket names a page with the same contents is merged into it,
+//   otherwise it takes over the bucket. Pages mapped all zero by vm_map_page and never written all merge into one.
+// - merged pages are not evicted to swap; a write to one of them through vm_translate copies it again
+// - takes frameLock once per page and hashes without it
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - budget: the maximum number of frames to look at
+// returns:
+// - the number of pages merged, i.e. physical pages freed
+size_t vm_dedup_scan(void *vm, size_t budget) {
+    metadata* metaData = (metadata*)vm;
+    uint32_t firstFrame = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    size_t merged = 0;
+
+    for(size_t scanned = 0; scanned < budget; scanned++){
+        uint32_t frame = firstFrame + __atomic_fetch_add(&metaData->dedupCursor, 1, __ATOMIC_RELAXED) % metaData->numPages;
+
+        // Only private data pages are merged, shared ones have no owner. mergePage checks again with the lock held.
+        if(__atomic_load_n(&metaData->frameOwner[frame], __ATOMIC_RELAXED) == 0) continue;
+        uint32_t hash = hashPage((void*)((uintptr_t)metaData->vmStart + ((uintptr_t)frame << 12)));
+
+        pthread_mutex_lock(&metaData->frameLock);
+        uint32_t* bucket = &metaData->dedupTable[hash & metaData->dedupMask];
+        if(mergePage(metaData, frame, *bucket)) merged++;
+        else *bucket = frame;
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    __atomic_fetch_add(&metaData->pagesMerged, merged, __ATOMIC_RELAXED);
+    return merged;
+}
+
+// description:
+// - adds a top-level page table for an address space
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: address space ID of for which the toplevel page table should be created
+// returns:
+// - the success status:
+//   - VM_OK if a new page table was created
+//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
+//   - VM_BAD_IO if accessing the swap file failed
+// - the physical address of the *top-level* page table for this address space (relevant only if status is VM_OK)
+// input invariants:
+// - 0 <= asid < asid_limit of vm_get_stats (at least 512, about one per physical page)
+// - asid is not currently active
+// output invariants:
+// - a toplevel page table for address space asid exists in physical memory
+vm_result_t vm_new_addr_space(void *vm, asid_t asid) {
+    // YOUR CODE HERE
+    metadata* metaData = (metadata*)vm;
+    vm_result_t result;
+    if(!metaData) return (vm_result_t){ .status = VM_DUPLICATE };
+
+    // Check if ASID already has an L1 table
+    if(asid >= metaData->numAsids) return (vm_result_t){ .status = VM_BAD_ADDR };
+    if(__atomic_load_n(&metaData->asid[asid], __ATOMIC_ACQUIRE) != 0) {
+        return (vm_result_t){ .status = VM_DUPLICATE };
+    }
+
+    // Allocate a page for the table, evicting a data page to swap if none is free
+    vm_status_t status;
+    // The page comes zeroed, so all entries are initially invalid
+    void* freePage = allocFrame(metaData, true, &status);
+    if(freePage == NULL) return (vm_result_t){ .status = status };
+
+    // The ASID table is only written with frameLock held, another thread may have won the race for asid
+    pthread_mutex_lock(&metaData->frameLock);
+    if(metaData->asid[asid] != 0) {
+        addFreePage(metaData, freePage);
+        pthread_mutex_unlock(&metaData->frameLock);
+        return (vm_result_t){ .status = VM_DUPLICATE };
+    }
+    
+    // Set the freePage to be one of the top level page tables, its occupancy word first:
+    // vm_get_stats reads it as soon as the ASID is published
+    metaData->frameCount[((uintptr_t)freePage - (uintptr_t)metaData->vmStart) >> 12] = 0;
+    __atomic_store_n(&metaData->asid[asid], (uintptr_t)freePage - (uintptr_t)metaData->vmStart, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metaData->frameLock);
+    result.status = VM_OK;
+    result.addr = (uintptr_t)freePage - (uintptr_t)metaData->vmStart;
+    return result;
+}
+
+
+
+// Will do the work of vm_destroy_addr_space on the tables at pt, with the lock of the address space and frameLock held.
+// Clearing the ASID is left to the caller.
+static vm_status_t destroyAddrSpace(void* vm, paddr_t pt){
+    // YOUR CODE HERE
+    metadata* metaData = (metadata*)vm;
+
+    // Get pointer to the top level page table
+    void* topLevelPage = (void*)(pt + (uintptr_t)vm);
+
+    if((uintptr_t)topLevelPage % 4096 != 0){ 
+        printf("Top level not aligned.\n");
+        return VM_BAD_IO;
+    }
+
+    // Loop through the groups of the top level page that have a valid entry. For each L2 table, iterate
+    // through its entries until all of its valid ones have been seen, freeing the physical pages they map to.
+    // Every entry visited is cleared, which leaves the tables zeroed without a memset.
+    uint32_t* occupancy = &metaData->frameCount[pt >> 12];
+    while(*occupancy){
+        uint32_t group = __builtin_ctz(*occupancy);
+        *occupancy &= *occupancy - 1;
+
+        for(uint32_t i = group * 32; i < group * 32 + 32; i++){
+            uint32_t* firstLevelEntry = (uint32_t*)topLevelPage + i;
+            if(!(*firstLevelEntry & PTE_VALID)) continue;
+
+            // A superpage owns its 1024 frames directly
+            if(*firstLevelEntry & PTE_LARGE){
+                releaseSuperpage(metaData, *firstLevelEntry);
+                storeEntry(firstLevelEntry, 0);
+                continue;
+            }
+
+            void* secondLevelPage = (void*)((uintptr_t)vm + (*firstLevelEntry & PTE_FRAME));
+            if((uintptr_t)secondLevelPage % 4096 != 0){ 
+                printf("Top level not aligned.\n");
+                return VM_BAD_IO;
+            }
+            // Iterate over second level page until every valid entry has been released
+            uint32_t* remaining = &metaData->frameCount[*firstLevelEntry >> 12];
+            for(uint32_t* secondLevelEntry = secondLevelPage; *remaining > 0; secondLevelEntry++){
+                //Check if entry is valid
+                if(*secondLevelEntry & PTE_VALID){
+                    // Free physical page or swap slot
+                    releaseMapping(metaData, secondLevelEntry);
+                    (*remaining)--;
+                }
+            }
+            addFreePage(metaData, secondLevelPage);
+            storeEntry(firstLevelEntry, 0);
+        }
+    }
+    addFreePage(metaData, topLevelPage);
+    tlbInvalidateSpace(metaData, pt);
+    return VM_OK;
+}
+
+// Will destroy every region of the address space at pt, each with its lock held, then its directories.
+// Clearing the ASID is left to the caller.
+static vm_status_t destroySpace(metadata* metaData, paddr_t pt){
+    paddr_t root;
+    for(uint32_t region = 0; (root = nextRegion(metaData, pt, &region)) != 0; region++){
+        // Lock-free readers that raced with the destruction walk again and find no translation
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        beginRemoval(&space->seq);
+        pthread_mutex_lock(&metaData->frameLock);
+        vm_status_t status = destroyAddrSpace(metaData, root);
+        pthread_mutex_unlock(&metaData->frameLock);
+        endRemoval(&space->seq);
+        pthread_mutex_unlock(&space->lock);
+        if(status != VM_OK) return status;
+    }
+#if VM_PAGE_TABLE_LEVELS == 4
+    releaseDirectories(metaData, pt);
+#endif
+    return VM_OK;
+}
+
+// description:
+// - entirely removes an address space
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: the ID of the address space to be removed
+// returns:
+// - the success status:
+//   - VM_OK if the address space was successfully removed
+//   - VM_BAD_ADDR if the toplevel page table for this address pace does not exist
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - 0 <= asid < asid_limit of vm_get_stats
+// - asid is currently active
+// output invariants:
+// - all pages and page tables used by address space asid are no longer allocated in physical memory or swap
+vm_status_t vm_destroy_addr_space(void *vm, asid_t asid) {
+    metadata* metaData = (metadata*)vm;
+
+    // Check if the address space has a top level page table
+    if(asid >= metaData->numAsids || metaData->asid[asid] == 0) return VM_BAD_ADDR;
+
+    // The ASID is cleared under the lock at pt before anything is freed, vm_get_stats checks it under the same
+    // lock before each step of its walk. It comes back if the destruction fails
+    paddr_t pt = metaData->asid[asid];
+    spaceLock* space = getSpaceLock(metaData, pt);
+    pthread_mutex_lock(&space->lock);
+    pthread_mutex_lock(&metaData->frameLock);
+    __atomic_store_n(&metaData->asid[asid], 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metaData->frameLock);
+    pthread_mutex_unlock(&space->lock);
+
+    vm_status_t status = destroySpace(metaData, pt);
+    if(status != VM_OK){
+        pthread_mutex_lock(&metaData->frameLock);
+        if(metaData->asid[asid] == 0) __atomic_store_n(&metaData->asid[asid], pt, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    return status;
+}
+
+// Will lock two address spaces in address order, so that two clones in opposite directions cannot deadlock.
+static void lockSpaces(spaceLock* first, spaceLock* second){
+    if(first > second){
+        spaceLock* swap = first;
+        first = second;
+        second = swap;
+    }
+    pthread_mutex_lock(&first->lock);
+    if(second != first) pthread_mutex_lock(&second->lock);
+}
+
+// Will unlock what lockSpaces locked.
+static void unlockSpaces(spaceLock* first, spaceLock* second){
+    pthread_mutex_unlock(&first->lock);
+    if(second != first) pthread_mutex_unlock(&second->lock);
+}
+
+// description:
+// - fills an empty top-level table with L2 tables sharing every page of another address space
+// - superpages of the source are split first and swapped out pages brought back in, so that
+//   every shared page is resident and has an ordinary L2 entry
+// - writable pages lose PTE_WRITE and gain PTE_COW in both address spaces, unless vm_map_shared shared them
+// - shared pages have no single owner and are not evicted, until a write makes them private again
+// - called with the locks of both address spaces held, and within beginRemoval / endRemoval of the source
+// arguments:
+// - metaData: the VM system metadata
+// - source: physical address of the top-level table being cloned
+// - clone: physical address of the new top-level table, all zero
+// returns:
+// - VM_OK, or why a table could not be allocated or a page brought in (VM_OUT_OF_MEM or VM_BAD_IO);
+//   what was cloned until then stays in place for the caller to destroy
+static vm_status_t cloneAddrSpace(metadata* metaData, paddr_t source, paddr_t clone){
+    uint32_t* sourceTable = (uint32_t*)((uintptr_t)metaData->vmStart + source);
+    uint32_t* cloneTable = (uint32_t*)((uintptr_t)metaData->vmStart + clone);
+    vm_status_t status;
+
+    // Only the groups of the top level table that have a valid entry are visited
+    uint32_t occupancy = metaData->frameCount[source >> 12];
+    while(occupancy){
+        uint32_t group = __builtin_ctz(occupancy);
+        occupancy &= occupancy - 1;
+
+        for(uint32_t i = group * 32; i < group * 32 + 32; i++){
+            uint32_t* firstLevelEntry = &sourceTable[i];
+            if(!(*firstLevelEntry & PTE_VALID)) continue;
+
+            if(*firstLevelEntry & PTE_LARGE){
+                uint32_t* secondLevelTable = allocFrame(metaData, false, &status);
+                if(secondLevelTable == NULL) return status;
+                splitSuperpage(metaData, firstLevelEntry, secondLevelTable);
+            }
+
+            // The new table comes zeroed, only the valid entries are copied into it
+            uint32_t* cloneSecondLevel = allocFrame(metaData, true, &status);
+            if(cloneSecondLevel == NULL) return status;
+            uintptr_t tableAddress = (uintptr_t)cloneSecondLevel - (uintptr_t)metaData->vmStart;
+            uint32_t* cloneCount = &metaData->frameCount[tableAddress >> 12];
+            *cloneCount = 0;
+            setFirstLevelEntry(metaData, &cloneTable[i], (tableAddress & PTE_FRAME) | (*firstLevelEntry & PTE_ADVICE) | PTE_VALID | PTE_PRESENT);
+
+            // Reference counts and owners are only touched with frameLock held, which also keeps evictions out
+            uint32_t* sourceSecondLevel = (uint32_t*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME));
+            uint32_t remaining = metaData->frameCount[*firstLevelEntry >> 12];
+            pthread_mutex_lock(&metaData->frameLock);
+            for(uint32_t j = 0; remaining > 0; j++){
+                if(!(sourceSecondLevel[j] & PTE_VALID)) continue;
+                remaining--;
+
+                // A reserved page is reserved in the clone as well, each gets its own page when touched
+                if(reservedEntry(sourceSecondLevel[j])){
+                    cloneSecondLevel[j] = sourceSecondLevel[j];
+                    (*cloneCount)++;
+                    continue;
+                }
+                if(!(sourceSecondLevel[j] & PTE_PRESENT)){
+                    status = swapIn(metaData, &sourceSecondLevel[j], true);
+                    if(status != VM_OK){
+                        pthread_mutex_unlock(&metaData->frameLock);
+                        return status;
+                    }
+                }
+                uint32_t pageTableEntry = sourceSecondLevel[j];
+                if(!(metaData->frameRefs[pageTableEntry >> 12] & FRAME_SHARED)){
+                    pageTableEntry = copyOnWriteEntry(pageTableEntry);
+                    storeEntry(&sourceSecondLevel[j], pageTableEntry);
+                }
+                cloneSecondLevel[j] = pageTableEntry;
+                (*cloneCount)++;
+                __atomic_store_n(&metaData->frameOwner[pageTableEntry >> 12], 0, __ATOMIC_RELAXED);
+                metaData->frameRefs[pageTableEntry >> 12]++;
+            }
+            pthread_mutex_unlock(&metaData->frameLock);
+        }
+    }
+    return VM_OK;
+}
+
+// description:
+// - creates address space dst_asid as a copy-on-write clone of address space src_asid
+// - every data page is shared rather than copied; a VM_WRITE translation of a shared page that
+//   was writable gives that address space its own copy of the page
+// - on failure nothing is left of dst_asid, the pages of src_asid stay shared with nobody
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - src_asid: the ID of the address space to clone
+// - dst_asid: the ID of the new address space
+// returns:
+// - the success status:
+//   - VM_OK if the clone was created
+//   - VM_BAD_ADDR if src_asid is not active
+//   - VM_DUPLICATE if dst_asid is already active
+//   - VM_OUT_OF_MEM if no free pages remain for the page tables of the clone, or for bringing in the swapped out
+//     pages of src_asid: shared pages are never evicted, so src_asid must fit in physical memory at once
+//   - VM_BAD_IO if accessing the swap file failed
+// - the physical address of the top-level page table of the clone (relevant only if status is VM_OK)
+// input invariants:
+// - 0 <= src_asid, dst_asid < asid_limit of vm_get_stats
+vm_result_t vm_clone_addr_space(void *vm, asid_t src_asid, asid_t dst_asid) {
+    metadata* metaData = (metadata*)vm;
+
+    if(src_asid >= metaData->numAsids || dst_asid >= metaData->numAsids) return (vm_result_t){ .status = VM_BAD_ADDR };
+    paddr_t source = __atomic_load_n(&metaData->asid[src_asid], __ATOMIC_ACQUIRE);
+    if(source == 0) return (vm_result_t){ .status = VM_BAD_ADDR };
+    if(__atomic_load_n(&metaData->asid[dst_asid], __ATOMIC_ACQUIRE) != 0) return (vm_result_t){ .status = VM_DUPLICATE };
+
+    // The clone gets its top-level table like vm_new_addr_space, but is only published once it is filled
+    vm_status_t status;
+    void* topLevelPage = allocFrame(metaData, true, &status);
+    if(topLevelPage == NULL) return (vm_result_t){ .status = status };
+    paddr_t clone = (uintptr_t)topLevelPage - (uintptr_t)metaData->vmStart;
+    metaData->frameCount[clone >> 12] = 0;
+
+    // Each region of the source is cloned into the region of the clone at the same addresses
+    paddr_t sourceRoot;
+    for(uint32_t region = 0; status == VM_OK && (sourceRoot = nextRegion(metaData, source, &region)) != 0; region++){
+        paddr_t cloneRoot = clone;
+#if VM_PAGE_TABLE_LEVELS == 4
+        cloneRoot = makeRegion(metaData, clone, (vaddr_t)region << 32, &status);
+        if(cloneRoot == 0) break;
+#endif
+
+        // Pages of the source lose their write permission, cached translations that still allow writes go too
+        spaceLock* sourceLock = getSpaceLock(metaData, sourceRoot);
+        spaceLock* cloneLock = getSpaceLock(metaData, cloneRoot);
+        lockSpaces(sourceLock, cloneLock);
+        beginRemoval(&sourceLock->seq);
+        status = cloneAddrSpace(metaData, sourceRoot, cloneRoot);
+        tlbInvalidateSpace(metaData, sourceRoot);
+        endRemoval(&sourceLock->seq);
+        unlockSpaces(sourceLock, cloneLock);
+    }
+
+    pthread_mutex_lock(&metaData->frameLock);
+    if(status == VM_OK && metaData->asid[dst_asid] != 0) status = VM_DUPLICATE;
+    if(status == VM_OK) __atomic_store_n(&metaData->asid[dst_asid], clone, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metaData->frameLock);
+
+    // Nobody else knows the clone before it is published, so it goes without racing anyone
+    if(status != VM_OK){
+        destroySpace(metaData, clone);
+        return (vm_result_t){ .status = status };
+    }
+    return (vm_result_t){ .status = VM_OK, .addr = clone };
+}
+
+// Will do the work of vm_map_page, with the lock of the address space held.
+static vm_status_t mapPage(void* vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read, bool lazy){
     // YOUR CODE HERE
     metadata* metaData = (metadata*)vm;
     uint32_t firstLevelIndex = getFirstLevel(addr);
     uint32_t secondLevelIndex = getSecondLevel(addr);
-    uint32_t pageOffset = getOffset(addr);
+    vm_status_t status;
+
+    uint32_t * firstLevelEntry = (uint32_t*)(pt + firstLevelIndex*4 + (uintptr_t)metaData->vmStart);
+
+    // Check if first level page entry is valid, if not we must allocate second level page
+    if(!(*(firstLevelEntry) & PTE_VALID)){
+        // Since L1 page entry is not valid, allocate L2 page.
+        
+        // Allocate a zeroed second level page, if no page can be found return the reason
+        void* newSecondLevelPage = allocFrame(metaData, true, &status);
+        if(newSecondLevelPage == NULL) return status;
+
+        // Put the second level page in first level entry with valid bit set
+        setFirstLevelEntry(metaData, firstLevelEntry, (((uintptr_t)newSecondLevelPage - (uintptr_t)vm) & PTE_FRAME) | PTE_VALID | PTE_PRESENT);
+    }
+    
+    // A superpage already maps every page of the region
+    if(*firstLevelEntry & PTE_LARGE) return VM_DUPLICATE;
+
+    // Look into second level page table and seek entry
+    uint32_t * secondLevelEntry = (uint32_t*)(((metadata*)vm)->vmStart + (*firstLevelEntry & PTE_FRAME) + secondLevelIndex*4);
+    
+    // Check if the second level page entry is valid, if yes, return VM_DUPLICATE.
+    // An eviction may be rewriting the entry meanwhile, but it never changes the valid bit.
+    if(loadEntry(secondLevelEntry) & PTE_VALID) return VM_DUPLICATE;
+    
+    // We now need to allocate a new physical page, unless the page is only reserved: vm_translate allocates it then.
+    // Check if their is an available page, if not return VM_OUT_OF_MEM (or VM_BAD_IO if evicting one failed)
+    void* newPhysicalPage = lazy ? NULL : allocFrame(metaData, true, &status);
+    if(newPhysicalPage == NULL && !lazy){
+        // Do not leave behind a second level page allocated just for this mapping
+        spaceLock* space = getSpaceLock(metaData, pt);
+        beginRemoval(&space->seq);
+        pthread_mutex_lock(&metaData->frameLock);
+        releaseTableIfEmpty(metaData, firstLevelEntry);
+        pthread_mutex_unlock(&metaData->frameLock);
+        endRemoval(&space->seq);
+        return status;
+    }
+
+    // Create the page table entry and set the permission bits
+    uint32_t pageTableEntry = lazy ? ((uint32_t)PTE_ZERO_SLOT << PTE_SLOT_SHIFT) | PTE_VALID : (((uintptr_t)newPhysicalPage - (uintptr_t)vm) & PTE_FRAME) | PTE_VALID | PTE_PRESENT;
+    if(user) pageTableEntry = pageTableEntry | PTE_USER;
+    if(exec) pageTableEntry = pageTableEntry | PTE_EXEC;
+    if(write) pageTableEntry = pageTableEntry | PTE_WRITE;
+    if(read) pageTableEntry = pageTableEntry | PTE_READ;
+
+    // Put the page table entry into the second level entry, and remember it so the page can be evicted.
+    // The eviction clock only picks the page up once the owner is set, after the entry.
+    storeEntry(secondLevelEntry, pageTableEntry);
+    if(!lazy) __atomic_store_n(&metaData->frameOwner[pageTableEntry >> 12], (uintptr_t)secondLevelEntry - (uintptr_t)vm, __ATOMIC_RELEASE);
+    metaData->frameCount[*firstLevelEntry >> 12]++;
+    __atomic_fetch_add(&metaData->pagesMapped, 1, __ATOMIC_RELAXED);
+
+    return VM_OK;
+}
+
+// description:
+// - creates a mapping for a new page in the virtual address space and map it to a physical page
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the virtual address on a page that is to be mapped (not necessarily the start of the page)
+// - user: the page is accessible from user-level processes
+// - exec: instructions may be fetched from this page
+// - write: data may be written to this page
+// - read: data may be read from this page
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if the mapping succeeded
+//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for this page already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read) {
+#if defined(VM_LATENCY_HISTOGRAMS)
+    uint64_t start = __rdtsc();
+#endif
+    vm_status_t status = enterRegion((metadata*)vm, &pt, &addr, true);
+    if(status == VM_OK){
+        spaceLock* space = getSpaceLock((metadata*)vm, pt);
+        pthread_mutex_lock(&space->lock);
+        status = mapPage(vm, pt, addr, user, exec, write, read, false);
+        pthread_mutex_unlock(&space->lock);
+    }
+#if defined(VM_LATENCY_HISTOGRAMS)
+    recordLatency(((metadata*)vm)->mapCycles, start);
+#endif
+    return status;
+}
 
-    uint32_t * firstLevelEntry = (uint32_t*)(pt + firstLevelIndex*4 + (uintptr_t)metaData->vmStart);
+// description:
+// - maps a page of the virtual address space without giving it a physical page yet (demand-zero)
+// - only the permissions are recorded; the first translation of the page that they allow gets it a zeroed
+//   physical page, or fails with VM_OUT_OF_MEM if none is free and none can be evicted
+// - otherwise the page is mapped like one of vm_map_page: it is a duplicate for later mappings and is unmapped
+//   by vm_unmap_page / vm_unmap_range
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the virtual address on a page that is to be reserved (not necessarily the start of the page)
+// - user: the page is accessible from user-level processes
+// - exec: instructions may be fetched from this page
+// - write: data may be written to this page
+// - read: data may be read from this page
+// returns:
+// - the success status of the reservation:
+//   - VM_OK if the page was reserved
+//   - VM_OUT_OF_MEM if no free page remains for its L2 table in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for this page already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_reserve_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read) {
+    vm_status_t status = enterRegion((metadata*)vm, &pt, &addr, true);
+    if(status != VM_OK) return status;
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    status = mapPage(vm, pt, addr, user, exec, write, read, true);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+}
 
-    // Check if first level page entry is valid, if not we must allocate second level page
-    if(!(*(firstLevelEntry) & 0b1)){
-        // Since L1 page entry is not valid, allocate L2 page.
-        
-        // If not free pages return out of mem
-        if (metaData->freePageHeader == 0) return VM_OUT_OF_MEM;
+// Will do the work of vm_map_shared, with the lock of the address space held.
+static vm_status_t mapShared(metadata* metaData, paddr_t pt, vaddr_t addr, paddr_t paddr, bool user, bool exec, bool write, bool read){
+    uint32_t frame = paddr >> 12;
+    uint32_t firstFrame = ((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) >> 12;
+    if(frame < firstFrame || frame >= firstFrame + metaData->numPages) return VM_BAD_ADDR;
 
-        // Allocate second level page
-        freePageNode* newSecondLevelPage = metaData->freePageHeader;
-        removeFreeList(vm, newSecondLevelPage);
+    uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + pt + getFirstLevel(addr)*4);
+    vm_status_t status;
+    if(!(*firstLevelEntry & PTE_VALID)){
+        void* newSecondLevelPage = allocFrame(metaData, true, &status);
+        if(newSecondLevelPage == NULL) return status;
+        setFirstLevelEntry(metaData, firstLevelEntry, (((uintptr_t)newSecondLevelPage - (uintptr_t)metaData->vmStart) & PTE_FRAME) | PTE_VALID | PTE_PRESENT);
+    }
+    if(*firstLevelEntry & PTE_LARGE) return VM_DUPLICATE;
 
-        // Clear the second level page
-        memset((void*)newSecondLevelPage, 0, 4096);
+    uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME) + getSecondLevel(addr)*4);
+    if(loadEntry(secondLevelEntry) & PTE_VALID) return VM_DUPLICATE;
 
-        // Put the second level page in first level entry with valid bit set
-        *firstLevelEntry = ((((uintptr_t)newSecondLevelPage - (uintptr_t)vm) << 12) & 0xFFFFF000) | 0b11;
+    // The page must be mapped already: either privately, in which case it is claimed from the eviction
+    // clock and from a racing vm_unmap_page like an eviction would, or by an earlier vm_map_shared.
+    // Superpage frames and pages shared copy-on-write are neither.
+    pthread_mutex_lock(&metaData->frameLock);
+    uint32_t owner = __atomic_load_n(&metaData->frameOwner[frame], __ATOMIC_ACQUIRE);
+    bool mapped = (metaData->frameRefs[frame] & FRAME_SHARED) != 0;
+    if(owner != 0 && __atomic_compare_exchange_n(&metaData->frameOwner[frame], &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        mapped = true;
+    }
+    if(!mapped){
+        spaceLock* space = getSpaceLock(metaData, pt);
+        beginRemoval(&space->seq);
+        releaseTableIfEmpty(metaData, firstLevelEntry);
+        endRemoval(&space->seq);
+        pthread_mutex_unlock(&metaData->frameLock);
+        return VM_BAD_ADDR;
     }
-    
-    // Look into second level page table and seek entry
-    uint32_t * secondLevelEntry = (uint32_t*)(((metadata*)vm)->vmStart + ((*firstLevelEntry >> 12)) + secondLevelIndex*4);
-    
-    // Check if the second level page entry is valid, if yes, return VM_DUPLICATE
-    if(*secondLevelEntry & 0b1) return VM_DUPLICATE;
-    
-    // We now need to allocate a new physical page
-    // Check if their is an available page, if not return VM_OUT_OF_MEM
-    if (metaData->freePageHeader == NULL) return VM_OUT_OF_MEM;
-    
-    // Allocate a page
-    freePageNode* newPhysicalPage = metaData->freePageHeader;
-    removeFreeList(vm, newPhysicalPage);
 
-    // Create the page table entry and set the permission bits
-    uint32_t pageTableEntry = ((uintptr_t)newPhysicalPage & 0xFFFFF000) | 0b11;
-    if(user) pageTableEntry = pageTableEntry | 0b100000;
-    if(exec) pageTableEntry = pageTableEntry | 0b10000;
-    if(write) pageTableEntry = pageTableEntry | 0b1000;
-    if(read) pageTableEntry = pageTableEntry | 0b100;
+    uint32_t pageTableEntry = (frame << 12) | PTE_VALID | PTE_PRESENT;
+    if(user) pageTableEntry |= PTE_USER;
+    if(exec) pageTableEntry |= PTE_EXEC;
+    if(write) pageTableEntry |= PTE_WRITE;
+    if(read) pageTableEntry |= PTE_READ;
+    storeEntry(secondLevelEntry, pageTableEntry);
+    metaData->frameRefs[frame] = (metaData->frameRefs[frame] + 1) | FRAME_SHARED;
+    metaData->frameCount[*firstLevelEntry >> 12]++;
+    pthread_mutex_unlock(&metaData->frameLock);
+    __atomic_fetch_add(&metaData->pagesMapped, 1, __ATOMIC_RELAXED);
+    return VM_OK;
+}
+
+// description:
+// - maps a page of the address space to a physical page that is already mapped elsewhere, sharing it
+// - the page is only freed when its last mapping is removed, by vm_unmap_page, vm_unmap_range or vm_destroy_addr_space
+// - writes through any mapping are seen by all of them, also after vm_clone_addr_space
+// - shared pages are not evicted to swap
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the virtual address on a page that is to be mapped (not necessarily the start of the page)
+// - paddr: a physical address on the page to share (not necessarily the start of the page)
+// - user: the page is accessible from user-level processes through this mapping
+// - exec: instructions may be fetched from the page through this mapping
+// - write: data may be written to the page through this mapping
+// - read: data may be read from the page through this mapping
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if the mapping succeeded
+//   - VM_BAD_ADDR if paddr is not on a resident page mapped by vm_map_page, vm_map_range or vm_map_shared
+//   - VM_DUPLICATE if a mapping for this page already exists
+//   - VM_OUT_OF_MEM if no page was left for a new L2 table
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_shared(void *vm, paddr_t pt, vaddr_t addr, paddr_t paddr, bool user, bool exec, bool write, bool read) {
+    vm_status_t status = enterRegion((metadata*)vm, &pt, &addr, true);
+    if(status != VM_OK) return status;
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    status = mapShared((metadata*)vm, pt, addr, paddr, user, exec, write, read);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+}
 
-    // Put the page table entry into the second level entry
-    *secondLevelEntry = pageTableEntry;
+// Will do the work of vm_map_superpage, with the lock of the address space held.
+static vm_status_t mapSuperpage(metadata* metaData, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read){
+    uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + pt + getFirstLevel(addr)*4);
+
+    if(*firstLevelEntry & PTE_VALID) return VM_DUPLICATE;
+
+    // Frames cached in the magazines may be what breaks up a run, bring them back before giving up
+    pthread_mutex_lock(&metaData->frameLock);
+    void* firstPage = takeFreePageRun(metaData, 1024, 1024);
+    pthread_mutex_unlock(&metaData->frameLock);
+    if(firstPage == NULL && metaData->numMagazines){
+        drainMagazines(metaData);
+        pthread_mutex_lock(&metaData->frameLock);
+        firstPage = takeFreePageRun(metaData, 1024, 1024);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    if(firstPage == NULL) return VM_OUT_OF_MEM;
+
+    // Create the L1 entry and set the permission bits
+    uint32_t superpage = (((uintptr_t)firstPage - (uintptr_t)metaData->vmStart) & PTE_SUPER_FRAME) | PTE_VALID | PTE_PRESENT | PTE_LARGE;
+    if(user) superpage = superpage | PTE_USER;
+    if(exec) superpage = superpage | PTE_EXEC;
+    if(write) superpage = superpage | PTE_WRITE;
+    if(read) superpage = superpage | PTE_READ;
+    setFirstLevelEntry(metaData, firstLevelEntry, superpage);
+    __atomic_fetch_add(&metaData->pagesMapped, 1024, __ATOMIC_RELAXED);
 
     return VM_OK;
 }
 
 // description:
-// - removes the mapping for the page that contains virtual address addr
-// - returns any unmapped pages and any page tables with no mappings to the free page pool
+// - maps a whole 4 MiB region to 1024 physically contiguous pages with a single L1 entry
+// - translations in the region need no L2 table and end the walk after one level
 // arguments:
 // - vm: a VM system handle returned from vm_init
-// - pt: physical address of the top-level page table of the address space
-// - addr: the virtual address on a page that is to be unmapped (not necessarily the start of the page)
+// - pt: physical address of the top-level page table
+// - addr: a virtual address in the 4 MiB region that is to be mapped (not necessarily its start)
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
 // returns:
-// - the success status of the unmapping:
-//   - VM_OK if the page was successfully unmapped
-//   - VM_BAD_ADDR if this address space has no mapping for virtual address addr
-//   - VM_BAD_IO if accessing the swap file failed
+// - the success status of the mapping:
+//   - VM_OK if the mapping succeeded
+//   - VM_OUT_OF_MEM if no 4 MiB aligned run of 1024 free physical pages exists (pages are not evicted for it)
+//   - VM_DUPLICATE if a mapping for any page of the region already exists
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_superpage(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read) {
+    vm_status_t status = enterRegion((metadata*)vm, &pt, &addr, true);
+    if(status != VM_OK) return status;
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    status = mapSuperpage((metadata*)vm, pt, addr, user, exec, write, read);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+}
 
-vm_status_t vm_unmap_page(void *vm, paddr_t pt, vaddr_t addr) {
+// Will do the work of vm_unmap_page, with the lock of the address space held and lock-free readers warned off.
+static vm_status_t unmapPage(void* vm, paddr_t pt, vaddr_t addr){
     // YOUR CODE HERE
     metadata* metaData = (metadata*)vm;
     // Get the specific bit sections
     uint32_t firstLevel = getFirstLevel(addr);
     uint32_t secondLevel = getSecondLevel(addr);
-    uint32_t offset = getOffset(addr);
 
     // Get the first level entry
     uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)vm + pt + firstLevel*4);
 
     // Check if first level entry is valid, if not return VM_BAD_ADDR
-    if(!(*firstLevelEntry & 0b1)) return VM_BAD_ADDR;
+    if(!(*firstLevelEntry & PTE_VALID)) return VM_BAD_ADDR;
+
+    // Unmapping part of a superpage first splits it into ordinary pages
+    if(*firstLevelEntry & PTE_LARGE){
+        vm_status_t status;
+        uint32_t* secondLevelTable = allocFrame(metaData, false, &status);
+        if(secondLevelTable == NULL) return status;
+        splitSuperpage(metaData, firstLevelEntry, secondLevelTable);
+    }
 
     // Get the second level page
-    void* secondLevelPage = (uintptr_t)vm + (*firstLevelEntry & 0xFFFFF000);
+    void* secondLevelPage = (void*)((uintptr_t)vm + (*firstLevelEntry & PTE_FRAME));
 
     // Get the second level entry
-    uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)secondLevelPage + secondLevel);
+    uint32_t* secondLevelEntry = (uint32_t*)((uintptr_t)secondLevelPage + secondLevel*4);
 
     // Check if the second level entry is valid, if not return VM_BAD_ADDR
-    if(!(*secondLevelEntry & 0b1)) return VM_BAD_ADDR;
+    uint32_t pageTableEntry = loadEntry(secondLevelEntry);
+    if(!(pageTableEntry & PTE_VALID)) return VM_BAD_ADDR;
+
+    // Set the second level entry to 0, forget any cached translation for it, and only then free the page.
+    // A resident page is claimed from the eviction clock and goes to the magazine without frameLock.
+    // A page that is swapped out, or that an eviction claimed first, is released with frameLock held.
+    uint32_t owner = (uintptr_t)secondLevelEntry - (uintptr_t)vm;
+    if((pageTableEntry & PTE_PRESENT) && __atomic_compare_exchange_n(&metaData->frameOwner[pageTableEntry >> 12], &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        storeEntry(secondLevelEntry, 0);
+        tlbInvalidatePage(metaData, pt, addr);
+        clearAccessBits(metaData, pageTableEntry >> 12);
+        if(__atomic_load_n(&metaData->frameSlot[pageTableEntry >> 12], __ATOMIC_RELAXED) != 0){
+            pthread_mutex_lock(&metaData->frameLock);
+            dropSwapCopy(metaData, pageTableEntry >> 12);
+            pthread_mutex_unlock(&metaData->frameLock);
+        }
+        freeFrame(metaData, (void*)((uintptr_t)vm + (pageTableEntry & PTE_FRAME)), false);
+    }else{
+        pthread_mutex_lock(&metaData->frameLock);
+        releaseMapping(metaData, secondLevelEntry);
+        tlbInvalidatePage(metaData, pt, addr);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    metaData->frameCount[*firstLevelEntry >> 12]--;
+
+    // Free the second level page if that was its last mapping.
+    // The top level page table stays allocated, it is only released by vm_destroy_addr_space
+    if(metaData->frameCount[*firstLevelEntry >> 12] == 0){
+        pthread_mutex_lock(&metaData->frameLock);
+        releaseTableIfEmpty(metaData, firstLevelEntry);
+        pthread_mutex_unlock(&metaData->frameLock);
+    }
+    __atomic_fetch_add(&metaData->pagesUnmapped, 1, __ATOMIC_RELAXED);
+    return VM_OK;
+}
+
+// description:
+// - removes the mapping for the page that contains virtual address addr
+// - returns any unmapped pages and any page tables with no mappings to the free page pool
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the virtual address on a page that is to be unmapped (not necessarily the start of the page)
+// returns:
+// - the success status of the unmapping:
+//   - VM_OK if the page was successfully unmapped
+//   - VM_BAD_ADDR if this address space has no mapping for virtual address addr
+//   - VM_BAD_IO if accessing the swap file failed
+vm_status_t vm_unmap_page(void *vm, paddr_t pt, vaddr_t addr) {
+#if defined(VM_LATENCY_HISTOGRAMS)
+    uint64_t start = __rdtsc();
+#endif
+    vm_status_t status = enterRegion((metadata*)vm, &pt, &addr, false);
+    if(status == VM_OK){
+        spaceLock* space = getSpaceLock((metadata*)vm, pt);
+        pthread_mutex_lock(&space->lock);
+        beginRemoval(&space->seq);
+        status = unmapPage(vm, pt, addr);
+        endRemoval(&space->seq);
+        pthread_mutex_unlock(&space->lock);
+    }
+#if defined(VM_LATENCY_HISTOGRAMS)
+    recordLatency(((metadata*)vm)->unmapCycles, start);
+#endif
+    return status;
+}
+
+// description:
+// - computes the virtual page numbers covered by a range of virtual addresses
+// arguments:
+// - addr: the first virtual address of the range
+// - len: the length of the range in bytes
+// - firstPage: receives the first virtual page number of the range
+// - endPage: receives the virtual page number after the last one of the range
+// returns:
+// - false if the range runs past the end of the virtual address space
+static bool rangePages(vaddr_t addr, size_t len, uint32_t* firstPage, uint32_t* endPage){
+    if((uint64_t)len > 0x100000000ull - addr) return false;
+    uint64_t end = ((uint64_t)addr + len + 4095) >> 12;
+    *firstPage = addr >> 12;
+    *endPage = (len == 0) ? *firstPage : (uint32_t)end;
+    return true;
+}
+
+// Will do the work of vm_unmap_range, with the lock of the address space held and lock-free readers warned off.
+static vm_status_t unmapRange(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len){
+    uint32_t firstPage, endPage;
+    if(!rangePages(addr, len, &firstPage, &endPage)) return VM_BAD_ADDR;
+
+    uint32_t unmapped = 0;
+    uint32_t runEnd;
+    for(uint32_t page = firstPage; page < endPage; page = runEnd){
+        runEnd = ((page | 1023) + 1 < endPage) ? (page | 1023) + 1 : endPage;
+        uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + pt + (page >> 10)*4);
+
+        if(!(*firstLevelEntry & PTE_VALID)) continue;
 
-    // Get the physical page
-    void* physicalPage = (uintptr_t)vm + (*secondLevelEntry & 0xFFFFF000);
+        // A superpage only partly inside the range is split into ordinary pages
+        if((*firstLevelEntry & PTE_LARGE) && runEnd - page != 1024){
+            vm_status_t status;
+            uint32_t* secondLevelTable = allocFrame(metaData, false, &status);
+            if(secondLevelTable == NULL) return status;
+            splitSuperpage(metaData, firstLevelEntry, secondLevelTable);
+        }
+
+        // Each run is released with frameLock held, so its pages are not handed out again before
+        // their TLB entries are gone
+        pthread_mutex_lock(&metaData->frameLock);
 
-    // Free the physical page and add it to the free list
-    memset(physicalPage, 0, 4096);
-    addFreeList(vm, physicalPage);
+        // A superpage entirely in the range goes away at once
+        if(*firstLevelEntry & PTE_LARGE){
+            releaseSuperpage(metaData, *firstLevelEntry);
+            setFirstLevelEntry(metaData, firstLevelEntry, 0);
+            tlbInvalidateRegion(metaData, pt, page << 12);
+            pthread_mutex_unlock(&metaData->frameLock);
+            unmapped += 1024;
+            continue;
+        }
 
-    // Set the second level entry to 0
-    *secondLevelEntry = 0;
+        // Clear the run of entries, stopping early once the table is empty.
+        // Long runs drop their TLB entries with one sweep instead of one lookup per page.
+        bool sweepTlb = (runEnd - page) > VM_TLB_SETS * VM_TLB_WAYS;
+        uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME));
+        uint32_t* liveEntries = &metaData->frameCount[*firstLevelEntry >> 12];
+        for(uint32_t runPage = page; runPage < runEnd && *liveEntries > 0; runPage++){
+            uint32_t* secondLevelEntry = &secondLevelTable[runPage & 1023];
+            if(!(*secondLevelEntry & PTE_VALID)) continue;
 
-    // Iterate over second level page to see if there is an active page
-    for(int i = 0; i < 4096; i+=4){
-        uint32_t* secondLevelEntryIterate = (uint32_t*)((uintptr_t)vm +(uintptr_t)secondLevelPage + i);
-        if(*secondLevelEntryIterate & 0b1){
-            return VM_OK;
+            releaseMapping(metaData, secondLevelEntry);
+            (*liveEntries)--;
+            if(!sweepTlb) tlbInvalidatePage(metaData, pt, runPage << 12);
+            unmapped++;
         }
+        if(sweepTlb) tlbInvalidateRegion(metaData, pt, page << 12);
+
+        releaseTableIfEmpty(metaData, firstLevelEntry);
+        pthread_mutex_unlock(&metaData->frameLock);
     }
+    if(unmapped == 0) return VM_BAD_ADDR;
+    __atomic_fetch_add(&metaData->pagesUnmapped, unmapped, __ATOMIC_RELAXED);
+    return VM_OK;
+}
 
-    // Free second level page
-    memset(secondLevelPage, 0, 4096);
-    addFreeList(vm, secondLevelPage);
+// Will do the work of vm_map_range and vm_reserve_range (lazy), with the lock of the address space held.
+static vm_status_t mapRange(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read, bool lazy){
+    uint32_t firstPage, endPage;
+    if(!rangePages(addr, len, &firstPage, &endPage)) return VM_BAD_ADDR;
+
+    uint32_t permissions = lazy ? ((uint32_t)PTE_ZERO_SLOT << PTE_SLOT_SHIFT) | PTE_VALID : PTE_VALID | PTE_PRESENT;
+    if(user) permissions = permissions | PTE_USER;
+    if(exec) permissions = permissions | PTE_EXEC;
+    if(write) permissions = permissions | PTE_WRITE;
+    if(read) permissions = permissions | PTE_READ;
+
+    vm_status_t status = VM_OK;
+    uint32_t page = firstPage;
+    uint32_t* firstLevelEntry = NULL;
+
+    while(page < endPage && status == VM_OK){
+        uint32_t runEnd = ((page | 1023) + 1 < endPage) ? (page | 1023) + 1 : endPage;
+        firstLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + pt + (page >> 10)*4);
+
+        // Allocate the second level page of this run if there is none yet
+        if(!(*firstLevelEntry & PTE_VALID)){
+            void* newSecondLevelPage = allocFrame(metaData, true, &status);
+            if(newSecondLevelPage == NULL) break;
+            setFirstLevelEntry(metaData, firstLevelEntry, (((uintptr_t)newSecondLevelPage - (uintptr_t)metaData->vmStart) & PTE_FRAME) | PTE_VALID | PTE_PRESENT);
+        }else if(*firstLevelEntry & PTE_LARGE){
+            status = VM_DUPLICATE;
+            break;
+        }
 
-    // Iterate over first level page to see if there is an active page
-    for(int i = 0; i < 4096; i+=4){
-        uint32_t* firstLevelEntryIterate = (uint32_t*)(pt + (uintptr_t)vm + i);
-        if(*firstLevelEntryIterate & 0b1){
-            return VM_OK;
+        // Fill the run of entries, each with a new physical page or, reserved, with none
+        uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME));
+        uint32_t* liveEntries = &metaData->frameCount[*firstLevelEntry >> 12];
+        for(; page < runEnd; page++){
+            uint32_t* secondLevelEntry = &secondLevelTable[page & 1023];
+            if(loadEntry(secondLevelEntry) & PTE_VALID){
+                status = VM_DUPLICATE;
+                break;
+            }
+            if(lazy){
+                storeEntry(secondLevelEntry, permissions);
+                (*liveEntries)++;
+                continue;
+            }
+            void* newPhysicalPage = allocFrame(metaData, true, &status);
+            if(newPhysicalPage == NULL) break;
+
+            uint32_t physicalAddress = (uintptr_t)newPhysicalPage - (uintptr_t)metaData->vmStart;
+            storeEntry(secondLevelEntry, (physicalAddress & PTE_FRAME) | permissions);
+            __atomic_store_n(&metaData->frameOwner[physicalAddress >> 12], (uintptr_t)secondLevelEntry - (uintptr_t)metaData->vmStart, __ATOMIC_RELEASE);
+            (*liveEntries)++;
+        }
+    }
+
+    // Pages rolled back below count as mapped and then unmapped
+    __atomic_fetch_add(&metaData->pagesMapped, page - firstPage, __ATOMIC_RELAXED);
+    if(status != VM_OK){
+        // Roll back everything mapped so far, then the second level page of the failed run if it is still empty
+        spaceLock* space = getSpaceLock(metaData, pt);
+        beginRemoval(&space->seq);
+        if(page > firstPage) unmapRange(metaData, pt, firstPage << 12, (size_t)(page - firstPage) << 12);
+        if(firstLevelEntry != NULL && (*firstLevelEntry & (PTE_VALID | PTE_LARGE)) == PTE_VALID){
+            pthread_mutex_lock(&metaData->frameLock);
+            releaseTableIfEmpty(metaData, firstLevelEntry);
+            pthread_mutex_unlock(&metaData->frameLock);
         }
+        endRemoval(&space->seq);
     }
+    return status;
+}
 
-    // Free first level page
-    memset((void*)(pt+(uintptr_t)vm), 0, 4096);
-    addFreeList(vm, (void*)(pt+(uintptr_t)vm));
+#if VM_PAGE_TABLE_LEVELS == 4
+// Will do the work of vm_unmap_range one region at a time, each with its lock held.
+static vm_status_t unmapRegions(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len){
+    if(!rangeInSpace(addr, len)) return VM_BAD_ADDR;
+    vm_status_t result = VM_BAD_ADDR;
+    size_t chunk;
+    for(size_t done = 0; done < len; done += chunk){
+        chunk = regionChunk(addr + done, len - done);
+        paddr_t root = findRegion(metaData, pt, addr + done);
+        if(root == 0) continue;
 
-    return VM_OK;
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        beginRemoval(&space->seq);
+        vm_status_t status = unmapRange(metaData, root, regionOffset(addr + done), chunk);
+        endRemoval(&space->seq);
+        pthread_mutex_unlock(&space->lock);
+
+        // A region with nothing mapped in the range only fails the call if no other region had anything
+        if(status == VM_OK) result = VM_OK;
+        else if(status != VM_BAD_ADDR) return status;
+    }
+    return result;
+}
+
+// Will do the work of vm_map_range / vm_reserve_range one region at a time, each with its lock held.
+// mapRange rolls back the region that fails, the regions mapped before it are unmapped here.
+static vm_status_t mapRegions(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read, bool lazy){
+    if(!rangeInSpace(addr, len)) return VM_BAD_ADDR;
+    vm_status_t status = VM_OK;
+    size_t done = 0;
+    while(done < len){
+        size_t chunk = regionChunk(addr + done, len - done);
+        paddr_t root = makeRegion(metaData, pt, addr + done, &status);
+        if(root == 0) break;
+
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        status = mapRange(metaData, root, regionOffset(addr + done), chunk, user, exec, write, read, lazy);
+        pthread_mutex_unlock(&space->lock);
+        if(status != VM_OK) break;
+        done += chunk;
+    }
+    if(status != VM_OK && done > 0) unmapRegions(metaData, pt, addr, done);
+    return status;
+}
+#endif
+
+// description:
+// - maps every page of a range of virtual addresses, each to a new physical page
+// - each L2 table is walked once for the run of pages it covers
+// - on failure nothing stays mapped: the pages and L2 tables allocated by this call are released
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if every page was mapped
+//   - VM_BAD_ADDR if the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for any page of the range already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    return mapRegions((metadata*)vm, pt, addr, len, user, exec, write, read, false);
+#else
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    vm_status_t status = mapRange((metadata*)vm, pt, addr, len, user, exec, write, read, false);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+#endif
+}
+
+// description:
+// - maps every page of a range of virtual addresses without giving them physical pages yet, see vm_reserve_page
+// - costs one entry write per page plus the L2 tables of the range, whatever the size of the range
+// - on failure nothing stays mapped: the L2 tables allocated by this call are released
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
+// returns:
+// - the success status of the reservation:
+//   - VM_OK if every page was reserved
+//   - VM_BAD_ADDR if the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM if no free pages remain for the L2 tables in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for any page of the range already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_reserve_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    return mapRegions((metadata*)vm, pt, addr, len, user, exec, write, read, true);
+#else
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    vm_status_t status = mapRange((metadata*)vm, pt, addr, len, user, exec, write, read, true);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+#endif
+}
+
+// description:
+// - removes the mappings of every page of a range of virtual addresses
+// - returns the unmapped pages and any page tables left with no mappings to the free page pool
+// - each L2 table is walked once and checked for emptiness once, superpages fully inside the range are freed whole
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// returns:
+// - the success status of the unmapping:
+//   - VM_OK if at least one page was unmapped (pages of the range that are not mapped are skipped)
+//   - VM_BAD_ADDR if no page of the range was mapped, or the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM / VM_BAD_IO if a superpage only partly inside the range could not be split;
+//     the pages before it have been unmapped
+vm_status_t vm_unmap_range(void *vm, paddr_t pt, vaddr_t addr, size_t len) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    return unmapRegions((metadata*)vm, pt, addr, len);
+#else
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    beginRemoval(&space->seq);
+    vm_status_t status = unmapRange((metadata*)vm, pt, addr, len);
+    endRemoval(&space->seq);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+#endif
+}
+
+// description:
+// - applies vm_advise to a range of the 2-level page table at pt
+// - called with the lock of the address space held, and within beginRemoval / endRemoval for VM_ADVICE_DONTNEED
+// arguments:
+// - metaData: the VM system metadata
+// - pt: physical address of the top-level page table
+// - addr: the first virtual address of the range
+// - len: the length of the range in bytes
+// - advice: what to expect of the range
+// returns:
+// - the status of vm_advise for the range
+static vm_status_t adviseRange(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len, vm_advice_t advice){
+    uint32_t firstPage, endPage;
+    if(!rangePages(addr, len, &firstPage, &endPage)) return VM_BAD_ADDR;
+
+    bool mapped = false;
+    uint32_t runEnd;
+    for(uint32_t page = firstPage; page < endPage; page = runEnd){
+        runEnd = ((page | 1023) + 1 < endPage) ? (page | 1023) + 1 : endPage;
+        uint32_t* firstLevelEntry = (uint32_t*)((uintptr_t)metaData->vmStart + pt + (page >> 10)*4);
+
+        if(!(*firstLevelEntry & PTE_VALID)) continue;
+
+        // Superpages stay resident, they are only split to drop their pages. One entirely in the range needs no
+        // new table, under memory pressure too: it becomes a table of reserved pages in one of its own frames
+        if(*firstLevelEntry & PTE_LARGE){
+            mapped = true;
+            if(advice != VM_ADVICE_DONTNEED) continue;
+            if(runEnd - page == 1024){
+                pthread_mutex_lock(&metaData->frameLock);
+                reserveSuperpage(metaData, firstLevelEntry);
+                tlbInvalidateRegion(metaData, pt, page << 12);
+                pthread_mutex_unlock(&metaData->frameLock);
+                continue;
+            }
+            vm_status_t status;
+            uint32_t* secondLevelTable = allocFrame(metaData, false, &status);
+            if(secondLevelTable == NULL) return status;
+            splitSuperpage(metaData, firstLevelEntry, secondLevelTable);
+        }
+        uint32_t* secondLevelTable = (uint32_t*)((uintptr_t)metaData->vmStart + (*firstLevelEntry & PTE_FRAME));
+
+        // The access pattern is kept in the L1 entry, for the whole table
+        if(advice == VM_ADVICE_NORMAL || advice == VM_ADVICE_SEQUENTIAL || advice == VM_ADVICE_RANDOM){
+            uint32_t hint = (advice == VM_ADVICE_SEQUENTIAL) ? PTE_SEQUENTIAL : (advice == VM_ADVICE_RANDOM) ? PTE_RANDOM : 0;
+            storeEntry(firstLevelEntry, (*firstLevelEntry & ~PTE_ADVICE) | hint);
+            for(uint32_t runPage = page; runPage < runEnd && !mapped; runPage++){
+                mapped = loadEntry(&secondLevelTable[runPage & 1023]) & PTE_VALID;
+            }
+            continue;
+        }
+
+        vm_status_t status = VM_OK;
+        bool sweepTlb = advice == VM_ADVICE_DONTNEED && (runEnd - page) > VM_TLB_SETS * VM_TLB_WAYS;
+        pthread_mutex_lock(&metaData->frameLock);
+        for(uint32_t runPage = page; runPage < runEnd; runPage++){
+            uint32_t* secondLevelEntry = &secondLevelTable[runPage & 1023];
+            uint32_t pageTableEntry = *secondLevelEntry;
+            if(!(pageTableEntry & PTE_VALID)) continue;
+            mapped = true;
+
+            if(advice == VM_ADVICE_WILLNEED){
+                // Resident pages, including those just read along with another, get a second chance
+                if(!(pageTableEntry & PTE_PRESENT)){
+                    status = swapIn(metaData, secondLevelEntry, !(*firstLevelEntry & PTE_RANDOM));
+                    if(status != VM_OK) break;
+                    __atomic_fetch_add(&metaData->prefetches, 1, __ATOMIC_RELAXED);
+                }
+                setReferenced(metaData, *secondLevelEntry >> 12);
+            }else if(advice == VM_ADVICE_COLD){
+                // Shared pages have no owner and are never evicted
+                uint32_t frame = pageTableEntry >> 12;
+                if(!(pageTableEntry & PTE_PRESENT) || metaData->frameOwner[frame] == 0) continue;
+                uint64_t bit = (uint64_t)1 << (frame % 64);
+                clearReferenced(metaData, frame);
+                if(!(__atomic_fetch_or(&metaData->cold[frame / 64], bit, __ATOMIC_RELAXED) & bit)){
+                    __atomic_fetch_add(&metaData->coldPages, 1, __ATOMIC_RELAXED);
+                }
+            }else{
+                // The entry becomes reserved again, a copy-on-write page gets back the write permission it lost
+                if(reservedEntry(pageTableEntry)) continue;
+                if((pageTableEntry & PTE_PRESENT) && (metaData->frameRefs[pageTableEntry >> 12] & FRAME_SHARED)) continue;
+                uint32_t permissions = pageTableEntry & PTE_PERMS;
+                if((pageTableEntry & (PTE_PRESENT | PTE_COW)) == (PTE_PRESENT | PTE_COW)) permissions |= PTE_WRITE;
+                releaseMapping(metaData, secondLevelEntry);
+                storeEntry(secondLevelEntry, ((uint32_t)PTE_ZERO_SLOT << PTE_SLOT_SHIFT) | permissions | PTE_VALID);
+                if(!sweepTlb) tlbInvalidatePage(metaData, pt, runPage << 12);
+            }
+        }
+        if(sweepTlb) tlbInvalidateRegion(metaData, pt, page << 12);
+        pthread_mutex_unlock(&metaData->frameLock);
+        if(status != VM_OK) return status;
+    }
+    return mapped ? VM_OK : VM_BAD_ADDR;
+}
+
+#if VM_PAGE_TABLE_LEVELS == 4
+// Will do the work of vm_advise one region at a time, each with its lock held.
+static vm_status_t adviseRegions(metadata* metaData, paddr_t pt, vaddr_t addr, size_t len, vm_advice_t advice){
+    if(!rangeInSpace(addr, len)) return VM_BAD_ADDR;
+    vm_status_t result = VM_BAD_ADDR;
+    size_t chunk;
+    for(size_t done = 0; done < len; done += chunk){
+        chunk = regionChunk(addr + done, len - done);
+        paddr_t root = findRegion(metaData, pt, addr + done);
+        if(root == 0) continue;
+
+        spaceLock* space = getSpaceLock(metaData, root);
+        pthread_mutex_lock(&space->lock);
+        if(advice == VM_ADVICE_DONTNEED) beginRemoval(&space->seq);
+        vm_status_t status = adviseRange(metaData, root, regionOffset(addr + done), chunk, advice);
+        if(advice == VM_ADVICE_DONTNEED) endRemoval(&space->seq);
+        pthread_mutex_unlock(&space->lock);
+
+        if(status == VM_OK) result = VM_OK;
+        else if(status != VM_BAD_ADDR) return status;
+    }
+    return result;
+}
+#endif
+
+// description:
+// - tells the VM system how a range of virtual addresses will be used, like madvise
+//   - VM_ADVICE_WILLNEED: brings in the swapped out and not yet translated reserved pages of the range now,
+//     evicting other pages if needed; they get a second chance against the eviction clock
+//   - VM_ADVICE_DONTNEED: frees the physical pages and swap slots of the range at once; the pages stay mapped with
+//     their permissions, as reserved pages (see vm_reserve_page) that read as zero when next translated.
+//     Pages mapped with vm_map_shared keep their contents, a copy-on-write page only drops its reference.
+//   - VM_ADVICE_SEQUENTIAL: a translation that brings in a page of the range also brings in the pages after it,
+//     up to 16 (VM_SEQUENTIAL_READAHEAD) within its 4 MiB, as long as free pages are at hand
+//   - VM_ADVICE_RANDOM: a translation that brings in a page of the range brings in that page only
+//   - VM_ADVICE_NORMAL: undoes VM_ADVICE_SEQUENTIAL and VM_ADVICE_RANDOM
+//   - VM_ADVICE_COLD: the resident pages of the range are the first the eviction takes, unless translated again
+// - VM_ADVICE_SEQUENTIAL, VM_ADVICE_RANDOM and VM_ADVICE_NORMAL apply to whole 4 MiB blocks of the address space, those
+//   the range touches, and only while they have mappings
+// - superpages are never swapped out, so only VM_ADVICE_DONTNEED affects them: it turns them into ordinary pages,
+//   reserved where the range covers them; one entirely inside the range needs no memory for its new L2 table
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - advice: what to expect of the range
+// returns:
+// - the success status of the advice:
+//   - VM_OK if at least one page of the range is mapped (pages of the range that are not mapped are skipped)
+//   - VM_BAD_ADDR if no page of the range is mapped, or the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM / VM_BAD_IO if VM_ADVICE_WILLNEED could not bring in a page, or VM_ADVICE_DONTNEED could
+//     not split a superpage only partly inside the range; the pages before it have already been handled
+// input invariants:
+// - advice is one of the vm_advice_t values
+vm_status_t vm_advise(void *vm, paddr_t pt, vaddr_t addr, size_t len, vm_advice_t advice) {
+#if VM_PAGE_TABLE_LEVELS == 4
+    return adviseRegions((metadata*)vm, pt, addr, len, advice);
+#else
+    spaceLock* space = getSpaceLock((metadata*)vm, pt);
+    pthread_mutex_lock(&space->lock);
+    if(advice == VM_ADVICE_DONTNEED) beginRemoval(&space->seq);
+    vm_status_t status = adviseRange((metadata*)vm, pt, addr, len, advice);
+    if(advice == VM_ADVICE_DONTNEED) endRemoval(&space->seq);
+    pthread_mutex_unlock(&space->lock);
+    return status;
+#endif
+}
+
+// Will tell whether a frame (slots false) or a swap slot (slots true) holds something a checkpoint must keep.
+// Frames cached in a magazine look in use, vm_checkpoint drains the magazines first. Slots whose page is in the
+// compressed pool are kept with the reserved area instead.
+static bool checkpointInUse(metadata* metaData, bool slots, uint32_t item){
+    if(slots) return !hbitmapTest(&metaData->swapSlotFree, item) && zswapFind(metaData, item) == ZSWAP_NONE;
+    return !hbitmapTest(&metaData->zeroedFrames, item) && !hbitmapTest(&metaData->dirtyFrames, item);
+}
+
+// description:
+// - finds the runs of in-use frames past the reserved ones, or of used swap slots
+// arguments:
+// - metaData: the VM system metadata
+// - slots: false for frames, true for swap slots
+// - image: the image to append the runs to, or NULL to only count them
+// - count: receives the number of runs
+// returns:
+// - false if writing to the image failed, true otherwise
+static bool checkpointRuns(metadata* metaData, bool slots, FILE* image, uint32_t* count){
+    uint32_t first = slots ? 0 : (uint32_t)(((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) / 4096);
+    uint32_t end = slots ? metaData->numSwapPages : first + metaData->numPages;
+
+    *count = 0;
+    for(uint32_t item = first; item < end; item++){
+        if(!checkpointInUse(metaData, slots, item)) continue;
+        checkpointRun run = { item, 0 };
+        while(item < end && checkpointInUse(metaData, slots, item)){
+            run.count++;
+            item++;
+        }
+        if(image != NULL && fwrite(&run, sizeof(run), 1, image) != 1) return false;
+        (*count)++;
+    }
+    return true;
+}
+
+// Will return the offset of the reserved area in a checkpoint image, the first page after the run tables.
+static long checkpointReservedOffset(const checkpointHeader* header){
+    size_t tablesEnd = sizeof(checkpointHeader) + ((size_t)header->frameRuns + header->slotRuns) * sizeof(checkpointRun);
+    return (long)((tablesEnd + 4095) & ~(size_t)4095);
+}
+
+// description:
+// - writes a checkpoint image of a VM system, from which vm_restore can bring it back:
+//   its metadata, free frame and swap slot state, page tables, resident pages and swapped out pages
+// - free frames are left out of the image, so its size follows the memory in use rather than num_phys_pages
+// - frames cached in the per-thread magazines go back to the free frames first
+// arguments:
+// - vm: a VM system handle returned from vm_init or vm_restore
+// - path: the file to write the image to; the image is written to a new file in the same directory and renamed
+//   over path once complete, so an existing image stays whole until then, also one a restored system uses
+// returns:
+// - VM_OK on success
+// - VM_BAD_IO if the image could not be written or the swap file could not be read; path is left as it was
+// input invariants:
+// - no other vm_* call runs on the VM system meanwhile
+vm_status_t vm_checkpoint(void *vm, const char *path) {
+    metadata* metaData = (metadata*)vm;
+    uint32_t reservedPages = (uint32_t)(((uintptr_t)metaData->firstPage - (uintptr_t)metaData->vmStart) / 4096);
+    drainMagazines(metaData);
+
+    // Truncating path in place would pull the pages from under a system restored from it, which maps them
+    size_t pathLength = strlen(path);
+    char* temporary = malloc(pathLength + sizeof(".XXXXXX"));
+    if(temporary == NULL) return VM_BAD_IO;
+    memcpy(temporary, path, pathLength);
+    memcpy(temporary + pathLength, ".XXXXXX", sizeof(".XXXXXX"));
+    int descriptor = mkstemp(temporary);
+    FILE* image = (descriptor >= 0) ? fdopen(descriptor, "wb") : NULL;
+    if(image == NULL){
+        if(descriptor >= 0){
+            close(descriptor);
+            remove(temporary);
+        }
+        free(temporary);
+        return VM_BAD_IO;
+    }
+
+    checkpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.metadataSize = sizeof(metadata);
+    header.magazineSize = VM_MAGAZINE_SIZE;
+    header.pageTableLevels = VM_PAGE_TABLE_LEVELS;
+    header.physPages = reservedPages + metaData->numPages;
+    header.reservedPages = reservedPages;
+    header.swapSlots = metaData->numSwapPages;
+    bool ok = checkpointRuns(metaData, false, NULL, &header.frameRuns) &&
+              checkpointRuns(metaData, true, NULL, &header.slotRuns) &&
+              fwrite(&header, sizeof(header), 1, image) == 1 &&
+              checkpointRuns(metaData, false, image, &header.frameRuns) &&
+              checkpointRuns(metaData, true, image, &header.slotRuns);
+
+    // Seeking past the end of the run tables leaves a hole that reads back as zeros
+    ok = ok && fseek(image, checkpointReservedOffset(&header), SEEK_SET) == 0 &&
+         fwrite(metaData->vmStart, 4096, reservedPages, image) == reservedPages;
+    for(uint32_t frame = reservedPages; ok && frame < header.physPages; frame++){
+        if(!checkpointInUse(metaData, false, frame)) continue;
+        ok = fwrite((char*)metaData->vmStart + (size_t)frame * 4096, 4096, 1, image) == 1;
+    }
+    for(uint32_t slot = 0; ok && slot < header.swapSlots; slot++){
+        if(!checkpointInUse(metaData, true, slot)) continue;
+        uint8_t page[4096];
+        void* buffer = page;
+        ok = swapFileTransfer(metaData, slot, &buffer, 1, false) == VM_OK && fwrite(page, 4096, 1, image) == 1;
+    }
+
+    if(fclose(image) != 0) ok = false;
+    if(ok) ok = rename(temporary, path) == 0;
+    if(!ok) remove(temporary);
+    free(temporary);
+    return ok ? VM_OK : VM_BAD_IO;
+}
+
+// Will read bytes at an offset of an image, retrying short reads.
+static bool readImage(int image, void* to, size_t bytes, off_t offset){
+    while(bytes > 0){
+        ssize_t done = pread(image, to, bytes, offset);
+        if(done <= 0) return false;
+        to = (char*)to + done;
+        bytes -= done;
+        offset += done;
+    }
+    return true;
+}
+
+// Will fill part of physical memory from an image. When the host pages line up the file is mapped privately
+// in place, so each page is only read when first touched; otherwise it is read right away.
+static bool loadImage(int image, void* to, size_t bytes, off_t offset){
+    long hostPage = sysconf(_SC_PAGESIZE);
+    if(hostPage > 0 && (uintptr_t)to % hostPage == 0 && offset % hostPage == 0 && bytes % hostPage == 0 &&
+       mmap(to, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image, offset) != MAP_FAILED) return true;
+    return readImage(image, to, bytes, offset);
+}
+
+// Will move a pointer into the reserved area of the checkpointed instance to the same place in physmem.
+static void* relocate(const void* pointer, uintptr_t oldStart, void* physmem){
+    return (char*)physmem + ((uintptr_t)pointer - oldStart);
+}
+
+// Will relocate the levels of a hierarchical bitmap, see relocate.
+static void relocateBitmap(hbitmap* bitmap, uintptr_t oldStart, void* physmem){
+    for(uint32_t level = 0; level < bitmap->levels; level++){
+        bitmap->level[level] = relocate(bitmap->level[level], oldStart, physmem);
+    }
+}
+
+// description:
+// - does the work of vm_restore on an open image
+// - the reserved area is read as is and its pointers rebased onto physmem, the locks in it are initialized again
+// - frames that were free may hold anything in physmem, so the ones marked zeroed are marked dirty instead
+// arguments:
+// - physmem, swap: see vm_restore
+// - image: the image file
+// returns:
+// - physmem on success, NULL otherwise
+static void* restoreImage(void* physmem, int image, FILE* swap){
+    checkpointHeader header;
+    if(!readImage(image, &header, sizeof(header), 0)) return NULL;
+    if(memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.metadataSize != sizeof(metadata) ||
+       header.magazineSize != VM_MAGAZINE_SIZE || header.pageTableLevels != VM_PAGE_TABLE_LEVELS || header.reservedPages >= header.physPages) return NULL;
+    if(header.swapSlots > 0 && (swap == NULL || fseek(swap, 0, SEEK_SET) != 0)) return NULL;
+
+    off_t offset = checkpointReservedOffset(&header);
+    if(!readImage(image, physmem, (size_t)header.reservedPages * 4096, offset)) return NULL;
+    offset += (off_t)header.reservedPages * 4096;
+
+    metadata* metaData = (metadata*)physmem;
+    uintptr_t oldStart = (uintptr_t)metaData->vmStart;
+    metaData->vmStart = physmem;
+    metaData->vmEnd = (char*)physmem + (size_t)header.physPages * 4096;
+    metaData->firstPage = (char*)physmem + (size_t)header.reservedPages * 4096;
+    metaData->swapFile = header.swapSlots ? swap : NULL;
+    metaData->frameOwner = relocate(metaData->frameOwner, oldStart, physmem);
+    metaData->frameRefs = relocate(metaData->frameRefs, oldStart, physmem);
+    metaData->referenced = relocate(metaData->referenced, oldStart, physmem);
+    metaData->accessed = relocate(metaData->accessed, oldStart, physmem);
+    metaData->written = relocate(metaData->written, oldStart, physmem);
+    metaData->cold = relocate(metaData->cold, oldStart, physmem);
+    metaData->frameSlot = relocate(metaData->frameSlot, oldStart, physmem);
+    metaData->frameCount = relocate(metaData->frameCount, oldStart, physmem);
+    metaData->asid = relocate(metaData->asid, oldStart, physmem);
+    metaData->dedupTable = relocate(metaData->dedupTable, oldStart, physmem);
+    metaData->spaceLocks = relocate(metaData->spaceLocks, oldStart, physmem);
+    metaData->magazines = relocate(metaData->magazines, oldStart, physmem);
+    relocateBitmap(&metaData->zeroedFrames, oldStart, physmem);
+    relocateBitmap(&metaData->dirtyFrames, oldStart, physmem);
+    relocateBitmap(&metaData->swapSlotFree, oldStart, physmem);
+    if(metaData->zswapPool != NULL) metaData->zswapPool = relocate(metaData->zswapPool, oldStart, physmem);
+    metaData->zswapEntries = relocate(metaData->zswapEntries, oldStart, physmem);
+    metaData->zswapBuckets = relocate(metaData->zswapBuckets, oldStart, physmem);
+    relocateBitmap(&metaData->zswapFreeUnits, oldStart, physmem);
+
+    pthread_mutex_init(&metaData->frameLock, NULL);
+    for(uint32_t i = 0; i <= metaData->spaceLockMask; i++){
+        pthread_mutex_init(&metaData->spaceLocks[i].lock, NULL);
+    }
+    for(uint32_t i = 0; i < metaData->numMagazines; i++){
+        pthread_mutex_init(&metaData->magazines[i].lock, NULL);
+        metaData->magazines[i].frames = relocate(metaData->magazines[i].frames, oldStart, physmem);
+    }
+
+    uint32_t frame = 0;
+    while(hbitmapNext(&metaData->zeroedFrames, frame, &frame)){
+        hbitmapClear(&metaData->zeroedFrames, frame);
+        hbitmapSet(&metaData->dirtyFrames, frame);
+        frame++;
+    }
+
+    for(uint32_t i = 0; i < header.frameRuns + header.slotRuns; i++){
+        checkpointRun run;
+        if(!readImage(image, &run, sizeof(run), sizeof(header) + (off_t)i * sizeof(run))) return NULL;
+
+        if(i < header.frameRuns){
+            if(run.first < header.reservedPages || run.count > header.physPages - run.first) return NULL;
+            if(!loadImage(image, (char*)physmem + (size_t)run.first * 4096, (size_t)run.count * 4096, offset)) return NULL;
+        }else{
+            if(run.first > header.swapSlots || run.count > header.swapSlots - run.first) return NULL;
+            for(uint32_t slot = run.first; slot < run.first + run.count; slot++){
+                uint8_t page[4096];
+                void* buffer = page;
+                if(!readImage(image, page, 4096, offset + (off_t)(slot - run.first) * 4096) ||
+                   swapFileTransfer(metaData, slot, &buffer, 1, true) != VM_OK) return NULL;
+            }
+        }
+        offset += (off_t)run.count * 4096;
+    }
+    return physmem;
+}
+
+// description:
+// - brings back a VM system from an image written by vm_checkpoint, in place of vm_init
+// - the address spaces, their mappings, page contents, swapped out pages and statistics are those of the
+//   checkpointed system; page table addresses stay valid since physical addresses are offsets from physmem
+// - when physmem is aligned to the host page size, resident pages are mapped from the image and only read
+//   from it when first touched, so restoring a large system costs little more than reading its metadata
+// arguments:
+// - physmem: pointer to an area of at least 4096 * num_phys_pages bytes, num_phys_pages being that of the
+//   checkpointed system; its previous contents are discarded
+// - path: the image file, which must stay unchanged while the restored system is in use
+// - swap: a swap file opened in read-write mode with at least as many pages as the checkpointed system used;
+//   the pages that were swapped out are written back to it. Ignored if the checkpointed system had no swap.
+// returns:
+// - on success, the handle of the restored VM instance, to be used like one returned from vm_init
+// - on failure (I/O error, image written by a differently configured build, or missing swap file), NULL
+void *vm_restore(void *physmem, const char *path, FILE *swap) {
+    if(physmem == NULL) return NULL;
+    int image = open(path, O_RDONLY);
+    if(image < 0) return NULL;
+
+    void* vm = restoreImage(physmem, image, swap);
+    close(image);
+    return vm;
 }
@@ -5,7 +5,20 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+// Page table layout, chosen at build time because it sets the width of vaddr_t. The library and its users must agree.
+// - 2 (default): 32-bit virtual addresses, a top-level table and L2 tables (10/10/12 split)
+// - 4: 48-bit virtual addresses, two directory levels (6/10 bits) above a 2-level table per 4 GiB region
+#ifndef VM_PAGE_TABLE_LEVELS
+#define VM_PAGE_TABLE_LEVELS 2
+#endif
+
+#if VM_PAGE_TABLE_LEVELS == 2
 typedef uint32_t vaddr_t; // virtual address
+#elif VM_PAGE_TABLE_LEVELS == 4
+typedef uint64_t vaddr_t; // virtual address, below 2^48
+#else
+#error "VM_PAGE_TABLE_LEVELS must be 2 or 4"
+#endif
 typedef uint32_t paddr_t; // physical address
 typedef uint32_t asid_t;  // address space identifier
 
@@ -24,11 +37,84 @@ typedef enum {
     VM_BAD_IO = 5      // I/O operation failed
 } vm_status_t;
 
+typedef enum {
+    VM_ADVICE_NORMAL = 0,     // no particular pattern, undoes VM_ADVICE_SEQUENTIAL / VM_ADVICE_RANDOM
+    VM_ADVICE_WILLNEED = 1,   // the pages will be used soon: bring them in now
+    VM_ADVICE_DONTNEED = 2,   // the contents are no longer needed: free the pages, which read as zero afterwards
+    VM_ADVICE_SEQUENTIAL = 3, // the pages will be used in increasing order: faults bring in the following pages
+    VM_ADVICE_RANDOM = 4,     // the pages will be used in no order: faults bring in only the page faulted on
+    VM_ADVICE_COLD = 5        // the pages will not be used for a while: evict them before any other page
+} vm_advice_t;
+
 typedef struct {
     vm_status_t status; // translation outcome
     paddr_t addr;       // translated physical address, relevant only if status is VM_OK
 } vm_result_t;
 
+typedef struct {
+    paddr_t addr;  // physical address where the run starts
+    uint32_t len;  // length of the run in bytes
+} vm_iovec_t;
+
+// Number of buckets in each latency histogram of vm_stats_t, bucket b counts calls that took 2^b to 2^(b+1) - 1 cycles
+#define VM_STATS_LATENCY_BUCKETS 32
+
+typedef struct {
+    // physical pages, at the time of the call
+    uint64_t total_pages;     // pages available for tables and data (after the reserved ones)
+    uint64_t reserved_pages;  // pages holding the metadata of the VM system and its compressed swap pool
+    uint64_t free_pages;      // free pages, zeroed or not
+    uint64_t zeroed_pages;    // free pages that are already zeroed (see vm_idle_zero)
+    uint64_t cached_pages;    // free pages held in the per-thread caches
+    uint64_t table_pages;     // pages holding page tables
+    uint64_t data_pages;      // pages holding data
+    uint64_t shared_pages;    // data pages mapped more than once (copy-on-write, vm_map_shared or merged)
+    uint64_t swap_slots;      // swap slots available to this instance
+    uint64_t swapped_pages;   // swap slots holding a page that is swapped out
+    uint64_t swap_copies;     // swap slots still holding a copy of a resident page, see vm_scan_working_set
+    uint64_t cold_pages;      // pages advised cold (VM_ADVICE_COLD) that the eviction has not taken or passed over yet
+    uint64_t compressed_pages; // swapped pages held in the compressed swap pool rather than the swap file
+    uint64_t compressed_bytes; // their compressed size
+    uint64_t address_spaces;  // active address spaces
+    uint64_t asid_limit;      // address space IDs go from 0 to asid_limit - 1
+    // events, since vm_init
+    uint64_t tlb_hits;        // translations served from the TLB
+    uint64_t tlb_misses;      // translations that walked the page table
+    uint64_t bad_addr;        // translations that failed with VM_BAD_ADDR
+    uint64_t bad_perm;        // translations that failed with VM_BAD_PERM
+    uint64_t swap_ins;        // pages brought back from swap
+    uint64_t swap_readahead;  // pages brought back from swap along with the one a translation faulted on
+    uint64_t evictions;       // pages moved out to swap
+    uint64_t clean_evictions; // evictions of pages unchanged since their swap in, which wrote nothing
+    uint64_t swap_file_reads; // pages read from the swap file
+    uint64_t swap_file_writes; // pages written to the swap file, when evicted or moved out of the compressed pool
+    uint64_t swap_io_calls;   // system calls reading or writing the swap file, each moving one or more pages
+    uint64_t cow_faults;      // writes to copy-on-write pages
+    uint64_t zero_fills;      // reserved pages given a zeroed physical page by their first translation
+    uint64_t prefetches;      // swap ins and zero fills done ahead of any translation, by vm_advise or sequential read ahead
+    uint64_t pages_mapped;    // pages mapped by vm_map_page, vm_map_range, vm_map_superpage, vm_map_shared and vm_reserve_*
+    uint64_t pages_unmapped;  // pages unmapped by vm_unmap_page and vm_unmap_range
+    uint64_t pages_merged;    // pages freed by vm_dedup_scan
+    // latency histograms in rdtsc cycles, all zero unless the library was built with -DVM_LATENCY_HISTOGRAMS
+    uint64_t translate_cycles[VM_STATS_LATENCY_BUCKETS];
+    uint64_t map_cycles[VM_STATS_LATENCY_BUCKETS];
+    uint64_t unmap_cycles[VM_STATS_LATENCY_BUCKETS];
+} vm_stats_t;
+
+typedef struct {
+    uint64_t resident_pages;  // mapped pages in physical memory (a superpage counts as 1024)
+    uint64_t swapped_pages;   // mapped pages in swap
+    uint64_t untouched_pages; // reserved pages not translated yet, in neither physical memory nor swap
+    uint64_t shared_pages;    // resident pages that are also mapped elsewhere
+    uint64_t table_pages;     // pages holding the page tables of the address space
+} vm_asid_stats_t;
+
+typedef struct {
+    uint64_t resident_pages;  // mapped pages in physical memory (a superpage counts as 1024)
+    uint64_t accessed_pages;  // resident pages translated since the previous scan
+    uint64_t dirty_pages;     // resident pages translated for VM_WRITE since the previous scan
+} vm_working_set_t;
+
 // description:
 // - initializes a VM system
 // arguments:
@@ -40,6 +126,8 @@ typedef struct {
 //   - physical page 0 starts at physmem
 // - swap
 //   - if non-null: pointer to a swap file opened in read-write mode with size 4096 * num_swap_pages bytes
+//     - unless built with -DVM_ZSWAP_PERCENT=0, a tenth of physical memory (VM_ZSWAP_PERCENT percent) then holds
+//       evicted pages compressed, and only pages that compress poorly or have aged out of it reach the file
 //   - if null: no swap space is available for this VM instance
 // - num_swap_pages: total number of 4096-byte pages available in the swap file
 //   - only relevant if swap is not null
@@ -47,6 +135,9 @@ typedef struct {
 // returns:
 // - on success, a non-NULL handle that uniquely identifies this VM instance;
 //   this will be passed unchanged to other vm_* functions
+//   - the handle may be used from several threads at once: calls on different address spaces
+//     only serialize while allocating or freeing physical pages, and vm_translate takes no lock
+//     when it finds the translation in the TLB or the page resident
 // - on failure (I/O error), NULL
 void *vm_init(void *physmem, size_t num_phys_pages, FILE *swap, size_t num_swap_pages);
 
@@ -58,6 +149,8 @@ void *vm_init(void *physmem, size_t num_phys_pages, FILE *swap, size_t num_swap_
 // - addr: the virtual address to translate
 // - access: the access being made (instruction fetch, read, or write)
 // - user: the access is a user-level access (i.e., not a kernel access)
+// - safe to call from several threads at once, also while other threads map and unmap pages;
+//   translations that hit the TLB or find a resident page take no lock
 // input invariants:
 // - pt was previously returned by vm_new_addr_space()
 // returns:
@@ -65,10 +158,112 @@ void *vm_init(void *physmem, size_t num_phys_pages, FILE *swap, size_t num_swap_
 //   - VM_OK if translation succeeded
 //   - VM_BAD_ADDR if there is no translation for this address
 //   - VM_BAD_PERM if permissions are not sufficient for the type / source of access requested
+//   - VM_OUT_OF_MEM if no physical page could be found for a swapped out or reserved page
 //   - VM_BAD_IO if accessing the swap file failed
 // - the resulting physical address (relevant only if status is VM_OK)
 vm_result_t vm_translate(void *vm, paddr_t pt, vaddr_t addr, access_type_t access, bool user);
 
+// description:
+// - translates many virtual addresses of one address space at once
+// - consecutive addresses that share an L1 entry walk it only once, so blocks with locality are cheapest
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space being accessed
+// - addrs: the virtual addresses to translate
+// - n: the number of addresses
+// - access: the access being made (instruction fetch, read, or write), same for all addresses
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// - out: array of n results, out[i] receives what vm_translate would return for addrs[i]
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+void vm_translate_batch(void *vm, paddr_t pt, const vaddr_t *addrs, size_t n, access_type_t access, bool user, vm_result_t *out);
+
+// description:
+// - translates a range of virtual addresses into the physically contiguous runs that back it, in order
+// - consecutive pages in consecutive frames share a run; each L2 table is walked once, without a lock
+// - the TLB is neither consulted nor filled; swapped out and copy-on-write pages go through vm_translate,
+//   and when memory is short, bringing one in may evict a page of a run found earlier in the same call
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space being accessed
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - access: the access being made (instruction fetch, read, or write), same for the whole range
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// - iov_out: receives the runs
+// - max_iov: the number of runs iov_out has room for
+// - n_iov: receives the number of runs written to iov_out
+// returns:
+// - VM_OK if the runs cover the range, or as much of it as max_iov runs can: the caller continues after them
+// - otherwise what vm_translate returned for the first page that failed (VM_BAD_ADDR also if the range runs
+//   past the end of the virtual address space); the runs cover the part of the range before that page
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_translate_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, access_type_t access, bool user, vm_iovec_t *iov_out, size_t max_iov, size_t *n_iov);
+
+// description:
+// - copies a range of virtual memory of an address space into a host buffer, with VM_READ accesses
+// - other threads may evict pages meanwhile: a page evicted between its translation and its copy is translated again
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address to read
+// - buf: receives len bytes
+// - len: the number of bytes
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// returns:
+// - VM_OK if the whole range was copied
+// - otherwise what vm_translate returned for the first page that could not be read; the bytes before it are copied
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_read(void *vm, paddr_t pt, vaddr_t addr, void *buf, size_t len, bool user);
+
+// description:
+// - copies a host buffer into a range of virtual memory of an address space, with VM_WRITE accesses
+// - other threads may evict pages meanwhile: a page evicted between its translation and its copy is translated again
+// - copy-on-write pages of the range get their private copy first, like with vm_translate
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address to write
+// - buf: the len bytes to write
+// - len: the number of bytes
+// - user: the accesses are user-level accesses (i.e., not kernel accesses)
+// returns:
+// - VM_OK if the whole range was written
+// - otherwise what vm_translate returned for the first page that could not be written; the bytes before it are written
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_write(void *vm, paddr_t pt, vaddr_t addr, const void *buf, size_t len, bool user);
+
+// description:
+// - zeroes free pages ahead of time so that allocations find them ready
+// - pages freed by vm_unmap_page / vm_destroy_addr_space are not cleared on that path; they are
+//   zeroed by this call, or on demand when an allocation finds no zeroed page
+// - meant to be called when the caller is idle (e.g. from a background thread or between simulation steps)
+// - uses non-temporal stores, so the zeroed pages do not displace the working set from the cache
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - budget: the maximum number of pages to zero
+// returns:
+// - the number of pages zeroed (less than budget once no dirty page is left)
+size_t vm_idle_zero(void *vm, size_t budget);
+
+// description:
+// - merges resident data pages with identical contents into one read-only copy-on-write page (like KSM)
+// - opt-in: nothing is merged unless this is called, e.g. from a background thread or between simulation steps
+// - each call looks at the next budget physical pages after the ones the previous call looked at
+// - pages are hashed to find candidates and compared byte for byte before they are merged;
+//   pages mapped by vm_map_page and never written are all zero, so they collapse into a single page
+// - a VM_WRITE translation of a merged page gives that address space its own copy again
+// - merged pages are not evicted to swap
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - budget: the maximum number of physical pages to look at
+// returns:
+// - the number of pages merged, i.e. physical pages returned to the free pages
+size_t vm_dedup_scan(void *vm, size_t budget);
+
 // description:
 // - adds a top-level page table for an address space
 // arguments:
@@ -81,7 +276,7 @@ vm_result_t vm_translate(void *vm, paddr_t pt, vaddr_t addr, access_type_t acces
 //   - VM_BAD_IO if accessing the swap file failed
 // - the physical address of the *top-level* page table for this address space (relevant only if status is VM_OK)
 // input invariants:
-// - 0 <= asid < 512
+// - 0 <= asid < asid_limit of vm_get_stats (at least 512, about one per physical page)
 // - asid is not currently active
 // output invariants:
 // - a toplevel page table for address space asid exists in physical memory
@@ -98,12 +293,39 @@ vm_result_t vm_new_addr_space(void *vm, asid_t asid);
 //   - VM_BAD_ADDR if the toplevel page table for this address pace does not exist
 //   - VM_BAD_IO if accessing the swap file failed
 // input invariants:
-// - 0 <= asid < 512
+// - 0 <= asid < asid_limit of vm_get_stats
 // - asid is currently active
 // output invariants:
 // - all pages and page tables used by address space asid are no longer allocated in physical memory or swap
 vm_status_t vm_destroy_addr_space(void *vm, asid_t asid);
 
+// description:
+// - creates address space dst_asid as a copy-on-write clone of address space src_asid (like fork)
+// - no data page is copied: both address spaces map the same physical pages, writable ones read-only
+//   and marked copy-on-write; a VM_WRITE translation of such a page gives that address space its own copy
+// - each physical page counts its mappings, so unmapping a shared page in one address space leaves it to the other
+// - shared pages are not evicted to swap until a write makes them private again; pages of src_asid that are
+//   swapped out are brought back in first, so every page of src_asid must fit in physical memory at once
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - src_asid: the ID of the address space to clone
+// - dst_asid: the ID of the new address space
+// returns:
+// - the success status:
+//   - VM_OK if the clone was created
+//   - VM_BAD_ADDR if src_asid is not active
+//   - VM_DUPLICATE if dst_asid is already active
+//   - VM_OUT_OF_MEM if no free pages remain for the page tables of the clone, or for bringing in the swapped out
+//     pages of src_asid, e.g. when src_asid maps more pages than physical memory holds (nothing of dst_asid is
+//     left)
+//   - VM_BAD_IO if accessing the swap file failed
+// - the physical address of the top-level page table of the clone (relevant only if status is VM_OK)
+// input invariants:
+// - 0 <= src_asid, dst_asid < asid_limit of vm_get_stats
+// output invariants:
+// - vm_translate gives both address spaces the same contents until one of them writes a page
+vm_result_t vm_clone_addr_space(void *vm, asid_t src_asid, asid_t dst_asid);
+
 // description:
 // - creates a mapping for a new page in the virtual address space and map it to a physical page
 // arguments:
@@ -124,6 +346,79 @@ vm_status_t vm_destroy_addr_space(void *vm, asid_t asid);
 // - pt was previously returned by vm_new_addr_space()
 vm_status_t vm_map_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read);
 
+// description:
+// - maps a page of the virtual address space without giving it a physical page yet (demand-zero)
+// - only the permissions are recorded; the first translation of the page that they allow gets it a zeroed
+//   physical page, or fails with VM_OUT_OF_MEM if none is free and none can be evicted
+// - otherwise the page is mapped like one of vm_map_page: it is a duplicate for later mappings and is unmapped
+//   by vm_unmap_page / vm_unmap_range
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the virtual address on a page that is to be reserved (not necessarily the start of the page)
+// - user: the page is accessible from user-level processes
+// - exec: instructions may be fetched from this page
+// - write: data may be written to this page
+// - read: data may be read from this page
+// returns:
+// - the success status of the reservation:
+//   - VM_OK if the page was reserved
+//   - VM_OUT_OF_MEM if no free page remains for its L2 table in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for this page already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_reserve_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read);
+
+// description:
+// - maps a page of the address space to a physical page that is already mapped elsewhere, sharing it
+//   (shared libraries, shared memory segments, kernel pages mapped into every address space)
+// - each physical page counts its mappings; vm_unmap_page, vm_unmap_range and vm_destroy_addr_space
+//   only return it to the free pages when its last mapping goes away
+// - writes through any mapping are seen by all of them, also in clones made by vm_clone_addr_space
+// - shared pages are not evicted to swap
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the virtual address on a page that is to be mapped (not necessarily the start of the page)
+// - paddr: a physical address on the page to share, e.g. from vm_translate in another address space
+// - user: the page is accessible from user-level processes through this mapping
+// - exec: instructions may be fetched from the page through this mapping
+// - write: data may be written to the page through this mapping
+// - read: data may be read from the page through this mapping
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if the mapping succeeded
+//   - VM_BAD_ADDR if paddr is not on a resident page mapped by vm_map_page, vm_map_range or vm_map_shared
+//     (pages of superpages and pages shared copy-on-write cannot be shared)
+//   - VM_DUPLICATE if a mapping for this page already exists
+//   - VM_OUT_OF_MEM if no free pages remain for a new L2 table
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_shared(void *vm, paddr_t pt, vaddr_t addr, paddr_t paddr, bool user, bool exec, bool write, bool read);
+
+// description:
+// - maps a whole 4 MiB region to 1024 physically contiguous pages with a single L1 entry (a superpage)
+// - translations in the region need no L2 table and end the walk after one level
+// - vm_unmap_page on a page of the region splits the superpage into 1024 ordinary pages first
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: a virtual address in the 4 MiB region that is to be mapped (not necessarily its start)
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if the mapping succeeded
+//   - VM_OUT_OF_MEM if no 4 MiB aligned run of 1024 free physical pages exists (pages are not evicted for it)
+//   - VM_DUPLICATE if a mapping for any page of the region already exists
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_superpage(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec, bool write, bool read);
+
 // description:
 // - removes the mapping for the page that contains virtual address addr
 // - returns any unmapped pages and any page tables with no mappings to the free page pool
@@ -138,4 +433,178 @@ vm_status_t vm_map_page(void *vm, paddr_t pt, vaddr_t addr, bool user, bool exec
 //   - VM_BAD_IO if accessing the swap file failed
 vm_status_t vm_unmap_page(void *vm, paddr_t pt, vaddr_t addr);
 
+// description:
+// - reports how effective the software TLB in front of vm_translate has been
+// - the TLB geometry is fixed at compile time by VM_TLB_SETS and VM_TLB_WAYS (powers of two)
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - hits: receives the number of translations served from the TLB (may be NULL)
+// - misses: receives the number of translations that walked the page table (may be NULL)
+void vm_tlb_stats(void *vm, uint64_t *hits, uint64_t *misses);
+
+// description:
+// - takes a snapshot of the state of the VM system (page usage) and of its event counters
+// - counting costs one relaxed atomic add per event on the hot paths; the page usage is computed by this call
+// - the snapshot is not atomic, calls running meanwhile may leave it slightly inconsistent
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - stats: receives the snapshot
+void vm_get_stats(void *vm, vm_stats_t *stats);
+
+// description:
+// - reports how much memory one address space uses (its resident set size, swapped pages and page tables)
+// - walks the page tables of the address space, so it costs time proportional to its size
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: the ID of the address space
+// - stats: receives the sizes
+// returns:
+// - VM_OK, or VM_BAD_ADDR if the address space is not active
+vm_status_t vm_get_asid_stats(void *vm, asid_t asid, vm_asid_stats_t *stats);
+
+// description:
+// - estimates the working set of an address space: how many of its resident pages were used since the previous scan
+// - harvests the accessed and written bits that translations set per physical page, and clears them for the next scan
+// - the bits live in bitmaps beside the page tables, so translations never write to a PTE; a page shared with
+//   other address spaces has one set of bits for all of them
+// - a page found written gives up the copy it kept in swap since its swap in, which is out of date
+// - walks the page tables of the address space, so it costs time proportional to its size
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - asid: the ID of the address space
+// - ws: receives the counts
+// returns:
+// - VM_OK, or VM_BAD_ADDR if the address space is not active
+vm_status_t vm_scan_working_set(void *vm, asid_t asid, vm_working_set_t *ws);
+
+// description:
+// - maps every page of a range of virtual addresses, each to a new physical page
+// - much cheaper than one vm_map_page per page: each L2 table is walked once for the run of pages it covers
+// - on failure nothing stays mapped: the pages and page tables allocated by this call are released
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
+// returns:
+// - the success status of the mapping:
+//   - VM_OK if every page was mapped
+//   - VM_BAD_ADDR if the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM if no free pages remain in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for any page of the range already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_map_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read);
+
+// description:
+// - maps every page of a range of virtual addresses without giving them physical pages yet, see vm_reserve_page
+// - costs one entry write per page plus the L2 tables of the range, whatever the size of the range
+// - on failure nothing stays mapped: the L2 tables allocated by this call are released
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - user: the pages are accessible from user-level processes
+// - exec: instructions may be fetched from these pages
+// - write: data may be written to these pages
+// - read: data may be read from these pages
+// returns:
+// - the success status of the reservation:
+//   - VM_OK if every page was reserved
+//   - VM_BAD_ADDR if the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM if no free pages remain for the L2 tables in the physical memory and any relevant swap
+//   - VM_DUPLICATE if a mapping for any page of the range already exists
+//   - VM_BAD_IO if accessing the swap file failed
+// input invariants:
+// - pt was previously returned by vm_new_addr_space()
+vm_status_t vm_reserve_range(void *vm, paddr_t pt, vaddr_t addr, size_t len, bool user, bool exec, bool write, bool read);
+
+// description:
+// - removes the mappings of every page of a range of virtual addresses
+// - returns the unmapped pages and any page tables left with no mappings to the free page pool
+// - each L2 table is walked once and checked for emptiness once; superpages entirely inside the range are freed whole
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// returns:
+// - the success status of the unmapping:
+//   - VM_OK if at least one page was unmapped (pages of the range that are not mapped are skipped)
+//   - VM_BAD_ADDR if no page of the range was mapped, or the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM / VM_BAD_IO if a superpage only partly inside the range could not be split;
+//     the pages before it have already been unmapped
+vm_status_t vm_unmap_range(void *vm, paddr_t pt, vaddr_t addr, size_t len);
+
+// description:
+// - tells the VM system how a range of virtual addresses will be used, like madvise
+//   - VM_ADVICE_WILLNEED: brings in the swapped out and not yet translated reserved pages of the range now,
+//     evicting other pages if needed; they get a second chance against the eviction clock
+//   - VM_ADVICE_DONTNEED: frees the physical pages and swap slots of the range at once; the pages stay mapped with
+//     their permissions, as reserved pages (see vm_reserve_page) that read as zero when next translated.
+//     Pages mapped with vm_map_shared keep their contents, a copy-on-write page only drops its reference.
+//   - VM_ADVICE_SEQUENTIAL: a translation that brings in a page of the range also brings in the pages after it,
+//     up to 16 (VM_SEQUENTIAL_READAHEAD) within its 4 MiB, as long as free pages are at hand
+//   - VM_ADVICE_RANDOM: a translation that brings in a page of the range brings in that page only
+//   - VM_ADVICE_NORMAL: undoes VM_ADVICE_SEQUENTIAL and VM_ADVICE_RANDOM
+//   - VM_ADVICE_COLD: the resident pages of the range are the first the eviction takes, unless translated again
+// - VM_ADVICE_SEQUENTIAL, VM_ADVICE_RANDOM and VM_ADVICE_NORMAL apply to whole 4 MiB blocks of the address space, those
+//   the range touches, and only while they have mappings
+// - superpages are never swapped out, so only VM_ADVICE_DONTNEED affects them: it turns them into ordinary pages,
+//   reserved where the range covers them; one entirely inside the range needs no memory for its new L2 table
+// arguments:
+// - vm: a VM system handle returned from vm_init
+// - pt: physical address of the top-level page table of the address space
+// - addr: the first virtual address of the range (not necessarily the start of a page)
+// - len: the length of the range in bytes
+// - advice: what to expect of the range
+// returns:
+// - the success status of the advice:
+//   - VM_OK if at least one page of the range is mapped (pages of the range that are not mapped are skipped)
+//   - VM_BAD_ADDR if no page of the range is mapped, or the range runs past the end of the virtual address space
+//   - VM_OUT_OF_MEM / VM_BAD_IO if VM_ADVICE_WILLNEED could not bring in a page, or VM_ADVICE_DONTNEED could
+//     not split a superpage only partly inside the range; the pages before it have already been handled
+// input invariants:
+// - advice is one of the vm_advice_t values
+vm_status_t vm_advise(void *vm, paddr_t pt, vaddr_t addr, size_t len, vm_advice_t advice);
+
+// description:
+// - writes a checkpoint image of a VM system, from which vm_restore can bring it back:
+//   its metadata, free frame and swap slot state, page tables, resident pages and swapped out pages
+// - free frames are left out of the image, so its size follows the memory in use rather than num_phys_pages
+// - frames cached in the per-thread magazines go back to the free frames first
+// arguments:
+// - vm: a VM system handle returned from vm_init or vm_restore
+// - path: the file to write the image to; the image is written to a new file in the same directory and renamed
+//   over path once complete, so an existing image stays whole until then, also one a restored system uses
+// returns:
+// - VM_OK on success
+// - VM_BAD_IO if the image could not be written or the swap file could not be read; path is left as it was
+// input invariants:
+// - no other vm_* call runs on the VM system meanwhile
+vm_status_t vm_checkpoint(void *vm, const char *path);
+
+// description:
+// - brings back a VM system from an image written by vm_checkpoint, in place of vm_init
+// - the address spaces, their mappings, page contents, swapped out pages and statistics are those of the
+//   checkpointed system; page table addresses stay valid since physical addresses are offsets from physmem
+// - when physmem is aligned to the host page size, resident pages are mapped from the image and only read
+//   from it when first touched, so restoring a large system costs little more than reading its metadata
+// arguments:
+// - physmem: pointer to an area of at least 4096 * num_phys_pages bytes, num_phys_pages being that of the
+//   checkpointed system; its previous contents are discarded
+// - path: the image file, which must stay unchanged while the restored system is in use
+// - swap: a swap file opened in read-write mode with at least as many pages as the checkpointed system used;
+//   the pages that were swapped out are written back to it. Ignored if the checkpointed system had no swap.
+// returns:
+// - on success, the handle of the restored VM instance, to be used like one returned from vm_init
+// - on failure (I/O error, image written by a differently configured build, or missing swap file), NULL
+void *vm_restore(void *physmem, const char *path, FILE *swap);
+
 #endif // __CPEN212VM_H__
@@ -0,0 +1,507 @@
+// Benchmark driver for the vm_* API.
+//
+// Runs a synthetic workload (or replays a trace) against one VM instance and reports, for vm_translate,
+// vm_map_page, vm_unmap_page, vm_new_addr_space and vm_destroy_addr_space: the number of calls, their
+// throughput, p50 / p99 latency, and the peak number of physical pages in use.
+//
+// Build (no build system needed, see README.md):
+//   gcc -O2 -pthread vmBench.c vmAlloc.c -o vmBench -lm
+//
+// Usage: vmBench [-w workload] [-t threads] [-n ops] [-W pages] [-p phys pages] [-s swap pages]
+//                [-S seed] [-f trace] [-o trace]
+// - workload: seq, random, zipf, churn or storm (default zipf)
+//   - seq:    map the working set in order, translate it front to back, unmap it
+//   - random: translate uniformly random pages of the working set, remapping a few of them as it goes
+//   - zipf:   like random, but pages are picked with a Zipf distribution (s = 0.99)
+//   - churn:  create an address space, map a few pages, touch them and destroy it, over and over
+//   - storm:  map bursts of 512 pages at random places and unmap them again
+// - every VM_WRITE translation that succeeds is followed by a vm_write filling the page with seeded data, from
+//   well to not at all compressible, so that evictions go through the compressed pool and the swap file
+//   (all-zero pages would be dropped as same-filled); the fill is not timed
+// - threads: threads running the workload at once, each on its own address spaces (default 1)
+// - ops: API calls per thread (default 1000000)
+// - pages: working set of each thread in pages (default 4096)
+// - -f replays a trace instead of running a workload (single thread), -o records the calls made to a trace
+//
+// Trace format: one call per line, numbers in hex, lines starting with '#' are ignored
+//   N asid                       vm_new_addr_space
+//   D asid                       vm_destroy_addr_space
+//   M asid vaddr perms           vm_map_page, perms is any of "uxwr" ("-" for none)
+//   U asid vaddr                 vm_unmap_page
+//   T asid vaddr access user     vm_translate, access is r, w or x and user is 0 or 1
+// M, U and T calls on an ASID without an address space count as failed and are not made
+
+// clock_gettime, getopt, ftruncate and fileno are not declared by strict -std= builds without it
+#define _DEFAULT_SOURCE
+
+#include "vmAlloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_CHURN_ASIDS 4 // Address spaces each thread cycles through in the churn workload
+#define BENCH_SAMPLE_EVERY 4096 // Calls between two samples of the physical page usage
+#define BENCH_FILL_UNIT 1024 // Written pages begin with one to four units of random bytes and repeat them
+
+typedef enum { OP_TRANSLATE, OP_MAP, OP_UNMAP, OP_NEW, OP_DESTROY, OP_KINDS } opKind;
+
+static const char* opNames[OP_KINDS] = { "vm_translate", "vm_map_page", "vm_unmap_page", "vm_new_addr_space", "vm_destroy_addr_space" };
+
+// Latencies of one kind of call made by one thread, in nanoseconds
+typedef struct {
+    uint64_t* samples;
+    size_t count;
+    size_t capacity;
+} latencyLog;
+
+typedef struct {
+    pthread_t thread;
+    uint32_t id;
+    uint64_t rng;
+    uint64_t fillSeed; // Seeds the contents of the pages the thread writes
+    size_t ops; // Calls left to make
+    size_t sinceSample;
+    paddr_t pt[512]; // Top-level table of each ASID this thread created, 0 if none
+    latencyLog logs[OP_KINDS];
+    uint64_t failures[OP_KINDS]; // Calls that did not return VM_OK
+} benchThread;
+
+static void* vm;
+static size_t physPages = 16384;
+static size_t swapPages = 0;
+static size_t workingSet = 4096;
+static const char* workload = "zipf";
+static double* zipfCdf;
+static FILE* recordFile;
+static pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t peakPages;
+
+// Will return a monotonic timestamp in nanoseconds.
+static uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Will return the next number of the thread's xorshift64* generator.
+static uint64_t nextRandom(benchThread* t){
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// Will return a random page of the working set, uniformly or Zipf distributed.
+// Zipf ranks are scattered over the working set so that the hot pages do not all share an L2 table.
+static uint32_t pickPage(benchThread* t, bool zipf){
+    if(!zipf) return nextRandom(t) % workingSet;
+    double u = (double)(nextRandom(t) >> 11) / (double)(1ull << 53);
+    size_t low = 0, high = workingSet - 1;
+    while(low < high){
+        size_t middle = (low + high) / 2;
+        if(zipfCdf[middle] < u) low = middle + 1;
+        else high = middle;
+    }
+    return (uint32_t)((low * 7919) % workingSet);
+}
+
+// Will fill the page at addr with data seeded by the thread and the address: its first one to four
+// BENCH_FILL_UNITs are random and repeated to the end of the page, so it compresses to about that size.
+static void fillPage(benchThread* t, asid_t asid, vaddr_t addr, bool user){
+    uint64_t page[512];
+    uint64_t state = t->fillSeed ^ (addr >> 12) * 0x9E3779B97F4A7C15ull;
+    uint32_t words = (uint32_t)(1 + (addr >> 12) % 4) * BENCH_FILL_UNIT / 8;
+    for(uint32_t i = 0; i < 512; i++){
+        if(i >= words){
+            page[i] = page[i - words];
+            continue;
+        }
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        page[i] = z ^ (z >> 31);
+    }
+    vm_write(vm, t->pt[asid], addr & ~(vaddr_t)0xFFF, page, 4096, user);
+}
+
+// Will append a latency to a log, growing it as needed.
+static void logLatency(latencyLog* log, uint64_t ns){
+    if(log->count == log->capacity){
+        log->capacity = log->capacity ? log->capacity * 2 : 4096;
+        log->samples = realloc(log->samples, log->capacity * sizeof(uint64_t));
+        if(log->samples == NULL){
+            fprintf(stderr, "out of memory for latency samples\n");
+            exit(1);
+        }
+    }
+    log->samples[log->count++] = ns;
+}
+
+// Will raise peakPages to the number of physical pages in use now, every BENCH_SAMPLE_EVERY calls of a thread.
+static void samplePages(benchThread* t){
+    if(++t->sinceSample < BENCH_SAMPLE_EVERY) return;
+    t->sinceSample = 0;
+
+    vm_stats_t stats;
+    vm_get_stats(vm, &stats);
+    uint64_t used = stats.total_pages - stats.free_pages - stats.cached_pages;
+    uint64_t peak = __atomic_load_n(&peakPages, __ATOMIC_RELAXED);
+    while(used > peak && !__atomic_compare_exchange_n(&peakPages, &peak, used, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Will write one call to the trace being recorded, if any.
+static void recordCall(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void recordCall(const char* format, ...){
+    if(recordFile == NULL) return;
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&recordLock);
+    vfprintf(recordFile, format, args);
+    pthread_mutex_unlock(&recordLock);
+    va_end(args);
+}
+
+// Will count one finished call: its latency, whether it failed, and the calls left.
+static void finishCall(benchThread* t, opKind kind, uint64_t start, vm_status_t status){
+    logLatency(&t->logs[kind], nowNs() - start);
+    if(status != VM_OK) t->failures[kind]++;
+    if(t->ops > 0) t->ops--;
+    samplePages(t);
+}
+
+// Will fail a call on an ASID the thread has no address space for, without making it: a top-level table at
+// physical address 0 would point the call at the metadata of the VM system.
+static bool withoutSpace(benchThread* t, asid_t asid, opKind kind){
+    if(t->pt[asid] != 0) return false;
+    finishCall(t, kind, nowNs(), VM_BAD_ADDR);
+    return true;
+}
+
+static vm_status_t timedTranslate(benchThread* t, asid_t asid, vaddr_t addr, access_type_t access, bool user){
+    recordCall("T %x %llx %c %d\n", asid, (unsigned long long)addr, "xrw"[access], user);
+    if(withoutSpace(t, asid, OP_TRANSLATE)) return VM_BAD_ADDR;
+    uint64_t start = nowNs();
+    vm_result_t result = vm_translate(vm, t->pt[asid], addr, access, user);
+    finishCall(t, OP_TRANSLATE, start, result.status);
+    if(result.status == VM_OK && access == VM_WRITE) fillPage(t, asid, addr, user);
+    return result.status;
+}
+
+static vm_status_t timedMap(benchThread* t, asid_t asid, vaddr_t addr, bool user, bool exec, bool write, bool read){
+    recordCall("M %x %llx %s%s%s%s%s\n", asid, (unsigned long long)addr, user ? "u" : "", exec ? "x" : "", write ? "w" : "", read ? "r" : "", (user || exec || write || read) ? "" : "-");
+    if(withoutSpace(t, asid, OP_MAP)) return VM_BAD_ADDR;
+    uint64_t start = nowNs();
+    vm_status_t status = vm_map_page(vm, t->pt[asid], addr, user, exec, write, read);
+    finishCall(t, OP_MAP, start, status);
+    return status;
+}
+
+static vm_status_t timedUnmap(benchThread* t, asid_t asid, vaddr_t addr){
+    recordCall("U %x %llx\n", asid, (unsigned long long)addr);
+    if(withoutSpace(t, asid, OP_UNMAP)) return VM_BAD_ADDR;
+    uint64_t start = nowNs();
+    vm_status_t status = vm_unmap_page(vm, t->pt[asid], addr);
+    finishCall(t, OP_UNMAP, start, status);
+    return status;
+}
+
+static vm_status_t timedNew(benchThread* t, asid_t asid){
+    recordCall("N %x\n", asid);
+    uint64_t start = nowNs();
+    vm_result_t result = vm_new_addr_space(vm, asid);
+    finishCall(t, OP_NEW, start, result.status);
+    if(result.status == VM_OK) t->pt[asid] = result.addr;
+    return result.status;
+}
+
+static vm_status_t timedDestroy(benchThread* t, asid_t asid){
+    recordCall("D %x\n", asid);
+    uint64_t start = nowNs();
+    vm_status_t status = vm_destroy_addr_space(vm, asid);
+    finishCall(t, OP_DESTROY, start, status);
+    if(status == VM_OK) t->pt[asid] = 0;
+    return status;
+}
+
+// Will map the working set in order, read and write it front to back until the calls are used up, then unmap it.
+static void runSequential(benchThread* t){
+    asid_t asid = t->id;
+    size_t pages = workingSet;
+    if(2 * pages + 2 > t->ops) pages = (t->ops > 2) ? (t->ops - 2) / 3 : 0;
+
+    timedNew(t, asid);
+    for(uint32_t page = 0; page < pages; page++){
+        timedMap(t, asid, page << 12, true, false, true, true);
+    }
+    for(uint32_t page = 0; pages > 0 && t->ops > pages + 1; page = (page + 1) % pages){
+        timedTranslate(t, asid, (page << 12) | (page & 0xFFC), (page & 1) ? VM_WRITE : VM_READ, true);
+    }
+    for(uint32_t page = 0; page < pages; page++){
+        timedUnmap(t, asid, page << 12);
+    }
+    timedDestroy(t, asid);
+}
+
+// Will map the working set, then mostly translate random pages of it; one call in ten unmaps a mapped page
+// or maps an unmapped one instead. The address space is destroyed at the end.
+static void runRandom(benchThread* t, bool zipf){
+    asid_t asid = t->id;
+    bool* mapped = calloc(workingSet, sizeof(bool));
+
+    timedNew(t, asid);
+    for(uint32_t page = 0; page < workingSet && t->ops > 1; page++){
+        mapped[page] = timedMap(t, asid, page << 12, true, false, true, true) == VM_OK;
+    }
+    while(t->ops > 1){
+        uint32_t page = pickPage(t, zipf);
+        uint64_t choice = nextRandom(t) % 10;
+        if(choice > 0 && mapped[page]){
+            timedTranslate(t, asid, (page << 12) | (uint32_t)(nextRandom(t) & 0xFFF), (choice & 1) ? VM_WRITE : VM_READ, true);
+        }else if(mapped[page]){
+            timedUnmap(t, asid, page << 12);
+            mapped[page] = false;
+        }else{
+            mapped[page] = timedMap(t, asid, page << 12, true, false, true, true) == VM_OK;
+        }
+    }
+    timedDestroy(t, asid);
+    free(mapped);
+}
+
+// Will keep replacing one of the thread's address spaces by a new one with 64 mapped and touched pages.
+static void runChurn(benchThread* t){
+    asid_t firstAsid = t->id * BENCH_CHURN_ASIDS;
+    for(uint32_t round = 0; t->ops > BENCH_CHURN_ASIDS; round++){
+        asid_t asid = firstAsid + round % BENCH_CHURN_ASIDS;
+        if(t->pt[asid] != 0) timedDestroy(t, asid);
+        if(timedNew(t, asid) != VM_OK) continue;
+
+        // The pages are spread over the address space, so each one tends to need its own L2 table
+        vaddr_t pages[64];
+        for(uint32_t i = 0; i < 64 && t->ops > BENCH_CHURN_ASIDS; i++){
+            pages[i] = (vaddr_t)(nextRandom(t) % workingSet) << 12;
+            if(i % 8 == 0) pages[i] = (vaddr_t)nextRandom(t) & 0xFFFFF000;
+            timedMap(t, asid, pages[i], true, false, true, true);
+        }
+        for(uint32_t i = 0; i < 256 && t->ops > BENCH_CHURN_ASIDS; i++){
+            timedTranslate(t, asid, pages[nextRandom(t) % 64], VM_READ, true);
+        }
+    }
+    for(asid_t asid = firstAsid; asid < firstAsid + BENCH_CHURN_ASIDS; asid++){
+        if(t->pt[asid] != 0) timedDestroy(t, asid);
+    }
+}
+
+// Will map a burst of 512 consecutive pages at a random place, touch a few and unmap them all, over and over.
+static void runStorm(benchThread* t){
+    asid_t asid = t->id;
+    timedNew(t, asid);
+    while(t->ops > 1){
+        uint32_t base = (uint32_t)(nextRandom(t) % (1048576 - 512));
+        for(uint32_t page = base; page < base + 512; page++){
+            timedMap(t, asid, page << 12, true, false, true, true);
+        }
+        for(uint32_t i = 0; i < 32; i++){
+            timedTranslate(t, asid, (base + (uint32_t)(nextRandom(t) % 512)) << 12, VM_WRITE, true);
+        }
+        for(uint32_t page = base; page < base + 512; page++){
+            timedUnmap(t, asid, page << 12);
+        }
+    }
+    timedDestroy(t, asid);
+}
+
+static void* runWorkload(void* arg){
+    benchThread* t = arg;
+    if(strcmp(workload, "seq") == 0) runSequential(t);
+    else if(strcmp(workload, "random") == 0) runRandom(t, false);
+    else if(strcmp(workload, "zipf") == 0) runRandom(t, true);
+    else if(strcmp(workload, "churn") == 0) runChurn(t);
+    else runStorm(t);
+    return NULL;
+}
+
+// description:
+// - replays a trace on the calling thread, see the format at the top of this file
+// arguments:
+// - t: the thread state the calls are timed into
+// - trace: the open trace file
+// returns:
+// - 0, or -1 if a line could not be parsed
+static int replayTrace(benchThread* t, FILE* trace){
+    char line[256];
+    for(size_t number = 1; fgets(line, sizeof(line), trace) != NULL; number++){
+        char op, perms[8], access;
+        unsigned int asid, user;
+        unsigned long long addr;
+        if(line[0] == '#' || line[0] == '\n') continue;
+
+        bool ok = false;
+        switch(line[0]){
+        case 'N':
+            if((ok = sscanf(line, "N %x", &asid) == 1 && asid < 512)) timedNew(t, asid);
+            break;
+        case 'D':
+            if((ok = sscanf(line, "D %x", &asid) == 1 && asid < 512)) timedDestroy(t, asid);
+            break;
+        case 'M':
+            if((ok = sscanf(line, "M %x %llx %7s", &asid, &addr, perms) == 3 && asid < 512)){
+                timedMap(t, asid, addr, strchr(perms, 'u') != NULL, strchr(perms, 'x') != NULL, strchr(perms, 'w') != NULL, strchr(perms, 'r') != NULL);
+            }
+            break;
+        case 'U':
+            if((ok = sscanf(line, "U %x %llx", &asid, &addr) == 2 && asid < 512)) timedUnmap(t, asid, addr);
+            break;
+        case 'T':
+            if((ok = sscanf(line, "%c %x %llx %c %u", &op, &asid, &addr, &access, &user) == 5 && asid < 512 && strchr("xrw", access) != NULL)){
+                timedTranslate(t, asid, addr, (access_type_t)(strchr("xrw", access) - "xrw"), user != 0);
+            }
+            break;
+        }
+        if(!ok){
+            fprintf(stderr, "trace line %zu: cannot parse: %s", number, line);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compareSamples(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Will print one line per kind of call, merging the logs of all threads.
+static void report(benchThread* threads, uint32_t threadCount, uint64_t wallNs){
+    uint64_t totalCalls = 0;
+    printf("%-22s %10s %8s %14s %9s %9s\n", "call", "count", "failed", "calls/s", "p50 ns", "p99 ns");
+    for(int kind = 0; kind < OP_KINDS; kind++){
+        size_t count = 0;
+        uint64_t failures = 0;
+        for(uint32_t i = 0; i < threadCount; i++){
+            count += threads[i].logs[kind].count;
+            failures += threads[i].failures[kind];
+        }
+        if(count == 0) continue;
+
+        uint64_t* samples = malloc(count * sizeof(uint64_t));
+        uint64_t spentNs = 0;
+        size_t filled = 0;
+        for(uint32_t i = 0; i < threadCount; i++){
+            memcpy(samples + filled, threads[i].logs[kind].samples, threads[i].logs[kind].count * sizeof(uint64_t));
+            filled += threads[i].logs[kind].count;
+        }
+        for(size_t i = 0; i < count; i++) spentNs += samples[i];
+        qsort(samples, count, sizeof(uint64_t), compareSamples);
+
+        // Throughput of the calls themselves: the threads spend spentNs / threadCount each in this kind of call
+        double perSecond = spentNs ? (double)count * threadCount * 1e9 / (double)spentNs : 0;
+        printf("%-22s %10zu %8lu %14.0f %9lu %9lu\n", opNames[kind], count, (unsigned long)failures, perSecond, (unsigned long)samples[count / 2], (unsigned long)samples[count * 99 / 100]);
+        totalCalls += count;
+        free(samples);
+    }
+
+    vm_stats_t stats;
+    vm_get_stats(vm, &stats);
+    printf("total: %lu calls in %.3f s, %.0f calls/s\n", (unsigned long)totalCalls, wallNs / 1e9, totalCalls * 1e9 / (double)wallNs);
+    printf("peak physical pages in use: %lu of %lu (sampled every %d calls of a thread)\n", (unsigned long)peakPages, (unsigned long)stats.total_pages, BENCH_SAMPLE_EVERY);
+    printf("tlb hits %lu, misses %lu, swap ins %lu, evictions %lu (%lu clean)\n", (unsigned long)stats.tlb_hits, (unsigned long)stats.tlb_misses, (unsigned long)stats.swap_ins, (unsigned long)stats.evictions, (unsigned long)stats.clean_evictions);
+    printf("swap file reads %lu, writes %lu, compressed pages %lu (%lu bytes)\n", (unsigned long)stats.swap_file_reads, (unsigned long)stats.swap_file_writes, (unsigned long)stats.compressed_pages, (unsigned long)stats.compressed_bytes);
+}
+
+static void usage(const char* program){
+    fprintf(stderr, "usage: %s [-w seq|random|zipf|churn|storm] [-t threads] [-n ops] [-W pages] [-p phys pages] [-s swap pages] [-S seed] [-f trace] [-o trace]\n", program);
+    exit(2);
+}
+
+int main(int argc, char** argv){
+    uint32_t threadCount = 1;
+    size_t ops = 1000000;
+    uint64_t seed = 1;
+    const char* tracePath = NULL;
+    const char* recordPath = NULL;
+
+    int option;
+    while((option = getopt(argc, argv, "w:t:n:W:p:s:S:f:o:")) != -1){
+        switch(option){
+        case 'w': workload = optarg; break;
+        case 't': threadCount = strtoul(optarg, NULL, 0); break;
+        case 'n': ops = strtoull(optarg, NULL, 0); break;
+        case 'W': workingSet = strtoull(optarg, NULL, 0); break;
+        case 'p': physPages = strtoull(optarg, NULL, 0); break;
+        case 's': swapPages = strtoull(optarg, NULL, 0); break;
+        case 'S': seed = strtoull(optarg, NULL, 0); break;
+        case 'f': tracePath = optarg; break;
+        case 'o': recordPath = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(strcmp(workload, "seq") && strcmp(workload, "random") && strcmp(workload, "zipf") && strcmp(workload, "churn") && strcmp(workload, "storm")) usage(argv[0]);
+    if(threadCount < 1 || threadCount > BENCH_MAX_THREADS || workingSet < 1 || workingSet > 1048576 || physPages < 4 || physPages > 1048576) usage(argv[0]);
+    if(strcmp(workload, "churn") == 0 && threadCount * BENCH_CHURN_ASIDS > 512) usage(argv[0]);
+    if(tracePath != NULL) threadCount = 1;
+
+    void* physmem = aligned_alloc(4096, physPages * 4096);
+    FILE* swap = swapPages ? tmpfile() : NULL;
+    if(physmem == NULL || (swapPages && (swap == NULL || ftruncate(fileno(swap), swapPages * 4096) != 0))){
+        fprintf(stderr, "cannot allocate physical memory or swap\n");
+        return 1;
+    }
+    vm = vm_init(physmem, physPages, swap, swapPages);
+    if(vm == NULL){
+        fprintf(stderr, "vm_init failed\n");
+        return 1;
+    }
+    if(recordPath != NULL && (recordFile = fopen(recordPath, "w")) == NULL){
+        perror(recordPath);
+        return 1;
+    }
+
+    // Zipf(0.99) over the working set: zipfCdf[k] is the probability of picking one of the k + 1 hottest pages
+    zipfCdf = malloc(workingSet * sizeof(double));
+    double sum = 0;
+    for(size_t k = 0; k < workingSet; k++){
+        sum += 1.0 / pow((double)(k + 1), 0.99);
+        zipfCdf[k] = sum;
+    }
+    for(size_t k = 0; k < workingSet; k++) zipfCdf[k] /= sum;
+
+    benchThread* threads = calloc(threadCount, sizeof(benchThread));
+    for(uint32_t i = 0; i < threadCount; i++){
+        threads[i].id = i;
+        threads[i].rng = (seed + i) * 0x9E3779B97F4A7C15ull | 1;
+        threads[i].fillSeed = nextRandom(&threads[i]);
+        threads[i].ops = ops;
+    }
+
+    uint64_t start = nowNs();
+    if(tracePath != NULL){
+        FILE* trace = fopen(tracePath, "r");
+        if(trace == NULL){
+            perror(tracePath);
+            return 1;
+        }
+        printf("trace %s, %zu physical pages, %zu swap pages\n", tracePath, physPages, swapPages);
+        if(replayTrace(&threads[0], trace) != 0) return 1;
+        fclose(trace);
+    }else{
+        printf("workload %s, %u thread(s), %zu calls per thread, working set %zu pages, %zu physical pages, %zu swap pages\n", workload, threadCount, ops, workingSet, physPages, swapPages);
+        for(uint32_t i = 0; i < threadCount; i++){
+            pthread_create(&threads[i].thread, NULL, runWorkload, &threads[i]);
+        }
+        for(uint32_t i = 0; i < threadCount; i++){
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+    uint64_t wallNs = nowNs() - start;
+
+    report(threads, threadCount, wallNs);
+    if(recordFile != NULL) fclose(recordFile);
+    return 0;
+}
@@ -0,0 +1,324 @@
+// Concurrency stress test for the vm_* API.
+//
+// Threads share one address space, each owning a slice of its pages: a thread maps and unmaps pages of its
+// slice, writes a pattern into the pages it maps and checks the pattern of its own pages, while it reads the
+// pages the other threads keep mapped and translates those they map and unmap. Every thread also keeps replacing a small
+// private address space, and one of them takes vm_get_stats snapshots meanwhile. At the end the page counts
+// of the VM system are checked against what the threads mapped, and nothing may be left once the address
+// spaces are destroyed. The run is repeated for 1, 2, 4, ... threads, reporting the throughput of each.
+//
+// Build (no build system needed, see README.md):
+//   gcc -O2 -pthread vmStress.c vmAlloc.c -o vmStress -lm
+//
+// Usage: vmStress [-t max threads] [-n ops] [-W pages] [-p phys pages] [-s swap pages] [-S seed]
+// - max threads: largest thread count of the sweep (default: the online CPUs, at most 64)
+// - ops: calls per run, split over its threads (default 2000000)
+// - pages: pages of the shared address space, split over the threads (default 12288)
+// - phys pages, swap pages: size of the VM system (default 4096 and 16384, so that pages get swapped)
+// Exits with 1 if a page had the wrong contents or the page counts did not add up.
+
+// clock_gettime, getopt, ftruncate, fileno and sysconf are not declared by strict -std= builds without it
+#define _DEFAULT_SOURCE
+
+#include "vmAlloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define STRESS_MAX_THREADS 64
+#define STRESS_SHARED_ASID 0 // The address space all threads work on; thread i churns ASID i + 1
+#define STRESS_CHURN_EVERY 1024 // Calls of a thread between two replacements of its private address space
+#define STRESS_CHURN_PAGES 16 // Pages mapped in each private address space
+#define STRESS_STATS_EVERY 4096 // Calls of thread 0 between two vm_get_stats snapshots
+#define STRESS_MAX_REPORTS 10 // Mismatches printed per run, the others are only counted
+
+typedef struct {
+    pthread_t thread;
+    uint32_t id;
+    uint64_t rng;
+    size_t ops; // Calls left to make
+    uint32_t firstPage; // The slice of the shared address space this thread maps
+    uint32_t pageCount;
+    bool* mapped; // Per page of the slice, whether the thread has it mapped
+    uint64_t mappedCount;
+    uint64_t outOfMemory; // Maps that failed for lack of memory, the page stays unmapped
+} stressThread;
+
+static void* vm;
+static stressThread threads[STRESS_MAX_THREADS];
+static uint32_t threadCount; // Threads of the run going on
+static pthread_barrier_t startBarrier;
+static paddr_t sharedPt;
+static uint32_t sharedPages; // Pages of the shared address space, over all slices
+static uint64_t seed = 1;
+static uint64_t errors;
+
+// Will return a monotonic timestamp in nanoseconds.
+static uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Will return the next number of the thread's xorshift64* generator.
+static uint64_t nextRandom(stressThread* t){
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545F4914F6CDD1Dull;
+}
+
+// Will return word i of the pattern of the page at addr. The pattern repeats every 1, 2 or 4 KiB depending on
+// the page, so evicted pages go to the compressed pool as well as to the swap file, and no word is ever 0.
+static uint64_t patternWord(vaddr_t addr, uint32_t i){
+    uint32_t period = 128u << ((addr >> 12) % 3);
+    uint64_t z = seed ^ (addr >> 12) * 0x9E3779B97F4A7C15ull ^ (uint64_t)(i % period) << 40;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (z ^ (z >> 31)) | 1;
+}
+
+// Will return the virtual address of page i of the shared address space.
+static vaddr_t pageAddress(uint32_t page){
+    return (vaddr_t)page << 12;
+}
+
+// Will count a word of a page that does not hold its pattern, printing the first few.
+static void mismatch(vaddr_t addr, uint32_t word, uint64_t value){
+    if(__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED) < STRESS_MAX_REPORTS){
+        fprintf(stderr, "page %llx word %u is %016llx, expected %016llx\n", (unsigned long long)addr, word, (unsigned long long)value, (unsigned long long)patternWord(addr, word));
+    }
+}
+
+// Will count a call that should have succeeded, printing the first few.
+static void failed(const char* call, vaddr_t addr, vm_status_t status){
+    if(__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED) < STRESS_MAX_REPORTS){
+        fprintf(stderr, "%s of page %llx failed with status %d\n", call, (unsigned long long)addr, status);
+    }
+}
+
+// Will check that a page read from the shared address space holds its whole pattern.
+static void checkPage(const uint64_t* page, vaddr_t addr){
+    for(uint32_t i = 0; i < 512; i++){
+        if(page[i] == patternWord(addr, i)) continue;
+        mismatch(addr, i, page[i]);
+        return;
+    }
+}
+
+// Will map page i of the thread's slice and write its pattern, or unmap it if it is mapped.
+static void togglePage(stressThread* t, uint32_t i){
+    vaddr_t addr = pageAddress(t->firstPage + i);
+    if(t->mapped[i]){
+        vm_status_t status = vm_unmap_page(vm, sharedPt, addr);
+        if(status != VM_OK) failed("vm_unmap_page", addr, status);
+        t->mapped[i] = false;
+        t->mappedCount--;
+        return;
+    }
+
+    vm_status_t status = vm_map_page(vm, sharedPt, addr, true, false, true, true);
+    if(status == VM_OUT_OF_MEM){
+        t->outOfMemory++;
+        return;
+    }
+    if(status != VM_OK){
+        failed("vm_map_page", addr, status);
+        return;
+    }
+    uint64_t page[512];
+    for(uint32_t word = 0; word < 512; word++) page[word] = patternWord(addr, word);
+    status = vm_write(vm, sharedPt, addr, page, sizeof(page), true);
+    if(status != VM_OK) failed("vm_write", addr, status);
+    t->mapped[i] = true;
+    t->mappedCount++;
+}
+
+// Will replace the thread's private address space by a new one with a few touched pages.
+static void churnSpace(stressThread* t){
+    asid_t asid = t->id + 1;
+    vm_destroy_addr_space(vm, asid);
+    vm_result_t space = vm_new_addr_space(vm, asid);
+    if(space.status != VM_OK) return;
+    for(uint32_t i = 0; i < STRESS_CHURN_PAGES; i++){
+        vaddr_t addr = (vaddr_t)(nextRandom(t) & 0xFFFFF) << 12;
+        if(vm_map_page(vm, space.addr, addr, true, false, true, true) == VM_OK) vm_translate(vm, space.addr, addr, VM_WRITE, true);
+    }
+}
+
+static void* runThread(void* arg){
+    stressThread* t = arg;
+    uint64_t page[512];
+
+    // The first half of each slice is mapped once, before any thread starts reading the slices of the others
+    uint32_t stable = t->pageCount / 2;
+    for(uint32_t i = 0; i < stable; i++) togglePage(t, i);
+    pthread_barrier_wait(&startBarrier);
+
+    for(size_t call = 0; call < t->ops; call++){
+        if(call % STRESS_CHURN_EVERY == 0) churnSpace(t);
+        if(t->id == 0 && call % STRESS_STATS_EVERY == 0){
+            vm_stats_t stats;
+            vm_get_stats(vm, &stats);
+        }
+
+        uint64_t choice = nextRandom(t) % 10;
+        stressThread* other = &threads[nextRandom(t) % threadCount];
+        if(choice == 0){
+            togglePage(t, stable + nextRandom(t) % (t->pageCount - stable));
+        }else if(choice < 4){
+            // Own pages: translated for writing now and then, so that they get dirty again, and read back
+            uint32_t i = nextRandom(t) % t->pageCount;
+            vaddr_t addr = pageAddress(t->firstPage + i);
+            if(!t->mapped[i]) continue;
+            vm_status_t status = (choice == 1) ? vm_translate(vm, sharedPt, addr, VM_WRITE, true).status : VM_OK;
+            if(status != VM_OK) failed("vm_translate", addr, status);
+            else if((status = vm_read(vm, sharedPt, addr, page, sizeof(page), true)) != VM_OK) failed("vm_read", addr, status);
+            else checkPage(page, addr);
+        }else if(choice < 7){
+            // The stable pages of any thread, which other threads keep evicting and bringing back in
+            uint32_t i = nextRandom(t) % stable;
+            vaddr_t addr = pageAddress(other->firstPage + i);
+            if(!other->mapped[i]) continue;
+            vm_status_t status = vm_read(vm, sharedPt, addr, page, sizeof(page), true);
+            if(status != VM_OK) failed("vm_read", addr, status);
+            else checkPage(page, addr);
+        }else{
+            // The other pages of any thread come and go, their translation may or may not succeed
+            vm_translate(vm, sharedPt, pageAddress(other->firstPage + stable + nextRandom(t) % (other->pageCount - stable)), VM_READ, true);
+        }
+    }
+    return NULL;
+}
+
+// description:
+// - runs the threads on a new VM system and checks its page counts afterwards
+// arguments:
+// - ops: calls split over the threads
+// - physPages, swapPages: size of the VM system
+// returns:
+// - the calls per second of the run, or 0 if the VM system could not be set up
+static double runThreads(size_t ops, size_t physPages, size_t swapPages){
+    void* physmem = aligned_alloc(4096, physPages * 4096);
+    FILE* swap = swapPages ? tmpfile() : NULL;
+    if(physmem == NULL || (swapPages && (swap == NULL || ftruncate(fileno(swap), swapPages * 4096) != 0))){
+        fprintf(stderr, "cannot allocate physical memory or swap\n");
+        return 0;
+    }
+    vm = vm_init(physmem, physPages, swap, swapPages);
+    vm_result_t shared = vm ? vm_new_addr_space(vm, STRESS_SHARED_ASID) : (vm_result_t){ .status = VM_BAD_ADDR };
+    if(shared.status != VM_OK){
+        fprintf(stderr, "vm_init failed\n");
+        return 0;
+    }
+    sharedPt = shared.addr;
+
+    memset(threads, 0, sizeof(threads));
+    uint32_t slice = sharedPages / threadCount;
+    for(uint32_t i = 0; i < threadCount; i++){
+        threads[i].id = i;
+        threads[i].rng = (seed + i) * 0x9E3779B97F4A7C15ull | 1;
+        threads[i].ops = ops / threadCount;
+        threads[i].firstPage = i * slice;
+        threads[i].pageCount = slice;
+        threads[i].mapped = calloc(slice, sizeof(bool));
+    }
+
+    pthread_barrier_init(&startBarrier, NULL, threadCount);
+    uint64_t start = nowNs();
+    for(uint32_t i = 0; i < threadCount; i++){
+        pthread_create(&threads[i].thread, NULL, runThread, &threads[i]);
+    }
+    for(uint32_t i = 0; i < threadCount; i++){
+        pthread_join(threads[i].thread, NULL);
+    }
+    uint64_t wallNs = nowNs() - start;
+    pthread_barrier_destroy(&startBarrier);
+
+    // Every page a thread mapped is in memory or in swap with its whole pattern, and holds no more memory
+    uint64_t mapped = 0, outOfMemory = 0;
+    uint64_t page[512];
+    for(uint32_t i = 0; i < threadCount; i++){
+        mapped += threads[i].mappedCount;
+        outOfMemory += threads[i].outOfMemory;
+        for(uint32_t j = 0; j < threads[i].pageCount; j++){
+            vaddr_t addr = pageAddress(threads[i].firstPage + j);
+            if(!threads[i].mapped[j]) continue;
+            vm_status_t status = vm_read(vm, sharedPt, addr, page, sizeof(page), true);
+            if(status != VM_OK) failed("vm_read", addr, status);
+            else checkPage(page, addr);
+        }
+        free(threads[i].mapped);
+    }
+    vm_asid_stats_t space;
+    vm_stats_t stats;
+    vm_get_asid_stats(vm, STRESS_SHARED_ASID, &space);
+    vm_get_stats(vm, &stats);
+    if(space.resident_pages + space.swapped_pages != mapped){
+        fprintf(stderr, "%lu pages mapped, but %lu resident and %lu swapped\n", (unsigned long)mapped, (unsigned long)space.resident_pages, (unsigned long)space.swapped_pages);
+        errors++;
+    }
+
+    // Once every address space is gone, so is every page and swap slot
+    for(asid_t asid = 0; asid <= threadCount; asid++) vm_destroy_addr_space(vm, asid);
+    vm_get_stats(vm, &stats);
+    if(stats.free_pages + stats.cached_pages != stats.total_pages || stats.swapped_pages != 0 || stats.compressed_pages != 0){
+        fprintf(stderr, "after destroying everything: %lu of %lu pages free, %lu swapped, %lu compressed\n", (unsigned long)(stats.free_pages + stats.cached_pages), (unsigned long)stats.total_pages, (unsigned long)stats.swapped_pages, (unsigned long)stats.compressed_pages);
+        errors++;
+    }
+
+    double perSecond = (double)(ops / threadCount * threadCount) * 1e9 / (double)wallNs;
+    printf("%7u %14.0f %10lu %10lu %10lu %10lu\n", threadCount, perSecond, (unsigned long)mapped, (unsigned long)outOfMemory, (unsigned long)stats.swap_ins, (unsigned long)stats.evictions);
+    if(swap != NULL) fclose(swap);
+    free(physmem);
+    return perSecond;
+}
+
+static void usage(const char* program){
+    fprintf(stderr, "usage: %s [-t max threads] [-n ops] [-W pages] [-p phys pages] [-s swap pages] [-S seed]\n", program);
+    exit(2);
+}
+
+int main(int argc, char** argv){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t maxThreads = (cpus < 1) ? 1 : (cpus > STRESS_MAX_THREADS) ? STRESS_MAX_THREADS : (uint32_t)cpus;
+    size_t ops = 2000000;
+    size_t physPages = 4096;
+    size_t swapPages = 16384;
+    sharedPages = 12288;
+
+    int option;
+    while((option = getopt(argc, argv, "t:n:W:p:s:S:")) != -1){
+        switch(option){
+        case 't': maxThreads = strtoul(optarg, NULL, 0); break;
+        case 'n': ops = strtoull(optarg, NULL, 0); break;
+        case 'W': sharedPages = strtoul(optarg, NULL, 0); break;
+        case 'p': physPages = strtoull(optarg, NULL, 0); break;
+        case 's': swapPages = strtoull(optarg, NULL, 0); break;
+        case 'S': seed = strtoull(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(maxThreads < 1 || maxThreads > STRESS_MAX_THREADS || sharedPages < 2 * maxThreads || sharedPages > 1048576 || physPages < 64 || physPages > 1048576) usage(argv[0]);
+
+    printf("%zu calls per run, %u shared pages, %zu physical pages, %zu swap pages\n", ops, sharedPages, physPages, swapPages);
+    printf("%7s %14s %10s %10s %10s %10s\n", "threads", "calls/s", "mapped", "no memory", "swap ins", "evictions");
+    double single = 0;
+    for(threadCount = 1; ; threadCount *= 2){
+        if(threadCount > maxThreads) threadCount = maxThreads;
+        double perSecond = runThreads(ops, physPages, swapPages);
+        if(perSecond == 0) return 1;
+        if(threadCount == 1) single = perSecond;
+        else printf("%7s speedup %.2fx over 1 thread\n", "", perSecond / single);
+        if(threadCount == maxThreads) break;
+    }
+
+    if(errors != 0){
+        printf("FAILED: %lu errors\n", (unsigned long)errors);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}